@@ -1,28 +1,36 @@
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include "mpc.h"
 #include "lval.h"
+#include "lgc.h"
+#include "lresolve.h"
+#include "lform.h"
+#include "lvm.h"
+#include "lfold.h"
+#include "lalloc.h"
+#include "lsym.h"
+#include "ljit.h"
 
 #define LASSERT(args, cond, fmt, ...) \
   if (!(cond)) { \
-    lval* err = lval_err(LERR_ERR, fmt, ##__VA_ARGS__); \
-    lval_del(args); \
-    return err; \
+    return lval_err(LERR_ERR, fmt, ##__VA_ARGS__); \
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->value.cell[index]->type == expect, \
+  LASSERT(args, lval_type(args[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->value.cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(lval_type(args[index])), ltype_name(expect))
 
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
+#define LASSERT_NUM(func, count, num) \
+  LASSERT(count, count == num, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, args->count, num)
+    func, count, num)
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->value.cell[index]->value.qexpr->count != 0, \
+  LASSERT(args, lval_type(args[index]->value.qexpr) == LVAL_LIST \
+    && args[index]->value.qexpr->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index)
 
 /* Add builtin function  */
@@ -31,83 +39,86 @@
  * list -> q_expr 
  * (a b c) -> '(a b c)
  */
-lval* builtin_list(lenv* e, lval* a) {
-  return lval_sexpr_quote(a);
+lval* builtin_list(lenv* e, int argc, lval** argv) {
+  return lval_sexpr_quote(lval_list_from(argc, argv));
 }
 
 /* Get first element from q-expr 
 * list(q-expr(list)) -> q-expr
 * ('(a b c)) -> 'a 
 */
-lval* builtin_head(lenv* e, lval* a) {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
+lval* builtin_head(lenv* e, int argc, lval** argv) {
+  LASSERT_NUM("head", argc, 1);
+  LASSERT_TYPE("head", argv, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("head", argv, 0);
   
-  lval* q = lval_list_take(a, 0);  
-  lval* v = lval_qexpr_unquote(q);
-  lval* x = lval_list_take(v, 0);
-  return lval_sexpr_quote(x);
+  lval* v = lval_qexpr_unquote(argv[0]);
+  return lval_sexpr_quote(v->value.cell[0]);
 }
 
 /* Take tail element from List Q-expression 
 *  list(qexpr(list)) -> qexpr(list) 
 *  ('(a b c)) -> '(b c)
 */
-lval* builtin_tail(lenv* e, lval* a) {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
+lval* builtin_tail(lenv* e, int argc, lval** argv) {
+  LASSERT_NUM("tail", argc, 1);
+  LASSERT_TYPE("tail", argv, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("tail", argv, 0);
 
-  lval* q = lval_list_take(a, 0);  
-  lval* v = lval_qexpr_unquote(q);
-  lval_del(lval_list_pop(v, 0));
-  return lval_sexpr_quote(v);
+  lval* v = lval_qexpr_unquote(argv[0]);
+  return lval_sexpr_quote(lval_list_tail(v, 1));
 }
 
 
-lval* builtin_def(lenv* e, lval* a) {
-  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+lval* builtin_def(lenv* e, int argc, lval** argv) {
+  LASSERT_TYPE("def", argv, 0, LVAL_QEXPR);
 
   /* First argument is symbol list */
-  lval* syms = lval_qexpr_pop(a->value.cell[0]);
+  lval* syms = argv[0]->value.qexpr;
+  LASSERT(argv, lval_type(syms) == LVAL_LIST,
+    "Function 'def' passed incorrect type for argument 0. "
+    "Got %s, Expected %s.",
+    ltype_name(lval_type(syms)), ltype_name(LVAL_LIST));
 
  /* Ensure all elements of first list are symbols */
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->value.cell[i]->type == LVAL_SYM,
+    LASSERT(argv, lval_type(syms->value.cell[i]) == LVAL_SYM,
       "Function 'def' cannot define non-symbol."
       "Got %s, Expected %s.",
-      ltype_name(syms->value.cell[i]->type), ltype_name(LVAL_SYM));
+      ltype_name(lval_type(syms->value.cell[i])), ltype_name(LVAL_SYM));
   }
 
   /* Check correct number of symbols and values */
-  LASSERT(a, syms->count == a->count-1,
+  LASSERT(argv, syms->count == argc-1,
     "Function 'def' cannot define incorrect "
     "number of values to symbols "
     "Got %i, Expected %i.",
-    syms->count, a->count-1);
+    syms->count, argc-1);
 
-  /* Assign copies of values to symbols */
+  /* Assign values to symbols */
   for (int i = 0; i < syms->count; i++) {
-    lenv_put(e, syms->value.cell[i], a->value.cell[i+1]);
+    lenv_put(e, syms->value.cell[i], argv[i+1]);
   }
 
-  lval_del(a);
   return lval_list();
 }
 
 /* Forward declaration*/
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_tree(lenv* e, lval* v);
+lval* lval_eval_tree_step(lenv* e, lval* v);
 
 /* Evalute list in q-expr
  * qexpr(list) -> lval
  * '(+ 1 2) -> 3
+ * The list is evaluated in place of the call, as a tail call.
  */
-lval* builtin_qexpr_eval(lenv* e, lval* a) {
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+lval* builtin_qexpr_eval(lenv* e, int argc, lval** argv) {
+  LASSERT_NUM("eval", argc, 1);
+  LASSERT_TYPE("eval", argv, 0, LVAL_QEXPR);
   
-  lval* x = lval_qexpr_unquote(a);
-  return lval_eval(e, x);
+  lval* x = lval_qexpr_unquote(argv[0]);
+  return lvm_tail(e, x);
 }
 
 
@@ -116,164 +127,806 @@ lval* builtin_qexpr_eval(lenv* e, lval* a) {
  * list(qexpr qexpr ...) -> list 
  * ('(a b c) '(d e)) -> '(a b c d e)
  */
-lval* builtin_join(lenv* e, lval* a) {
+lval* builtin_join(lenv* e, int argc, lval** argv) {
 
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-    LASSERT(a, a->value.cell[i]->value.qexpr->type == LVAL_LIST,
+  for (int i = 0; i < argc; i++) {
+    LASSERT_TYPE("join", argv, i, LVAL_QEXPR);
+    LASSERT(argv, lval_type(argv[i]->value.qexpr) == LVAL_LIST,
       "Function 'join' passed incorrect type."
       "Got %s, Expected: %s. ",
-       ltype_name(a->value.cell[i]->value.qexpr->type), ltype_name(LVAL_LIST));
+       ltype_name(lval_type(argv[i]->value.qexpr)), ltype_name(LVAL_LIST));
   }
   
-  lval* q = lval_list_pop(a, 0);
-  lval* x = lval_qexpr_unquote(q);
-  
-  while (a->count) {
-    q = lval_list_pop(a, 0);
-    x = lval_list_join(x, lval_qexpr_unquote(q));
+  /* Size the result once and copy each list into place */
+  int n = 0;
+  for (int i = 0; i < argc; i++) { n += lval_qexpr_unquote(argv[i])->count; }
+
+  lval* x = lval_list();
+  x->count = n;
+  x->value.cell = lcells_alloc(x, n);
+  n = 0;
+  for (int i = 0; i < argc; i++) {
+    lval* l = lval_qexpr_unquote(argv[i]);
+    if (l->count) {
+      memcpy(&x->value.cell[n], l->value.cell, sizeof(lval*) * l->count);
+    }
+    n += l->count;
   }
   
-  lval_del(a);
   return lval_sexpr_quote(x);
 }
 
+/* Set the pause budget of each major collection slice
+ * list(num [num]) -> list
+ * (gc-budget 500) -> ()        slices of about 500 microseconds
+ * (gc-budget 0 1000) -> ()     slices of 1000 values
+ * (gc-budget 0) -> ()          stop the world
+ */
+lval* builtin_gc_budget(lenv* e, int argc, lval** argv) {
+  LASSERT(argv, argc == 1 || argc == 2,
+    "Function 'gc-budget' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", argc);
+  for (int i = 0; i < argc; i++) {
+    LASSERT_TYPE("gc-budget", argv, i, LVAL_NUM);
+    LASSERT(argv, lval_num_value(argv[i]) >= 0,
+      "Function 'gc-budget' passed a negative budget.");
+  }
+
+  lgc_policy p;
+  lgc_get_policy(&p);
+  p.slice_us = lval_num_value(argv[0]);
+  p.slice_objects = argc == 2 ? lval_num_value(argv[1]) : 0;
+  lgc_set_policy(&p);
+
+  return lval_list();
+}
+
+/* Q-expr of the n numbers of x */
+static lval* lstats_list(int n, const long* x) {
+  lval* q = lval_sexpr_quote(lval_list());
+  for (int i = 0; i < n; i++) { lval_list_add(q->value.qexpr, lval_num(x[i])); }
+  return q;
+}
+
+/* Major collections, heap size and pause quantiles in microseconds
+ * '(collections heap-bytes minor-p50 minor-p99 major-p50 major-p99)
+ * A quantile is 0 when there was no pause of that kind.
+ */
+static lval* lstats_gc(void) {
+  lgc_stats s;
+  lgc_get_stats(&s);
+  long x[6] = {
+    s.collections, (long)s.heap_bytes,
+    lgc_pause_quantile(s.minor_pause_histogram, 0.50),
+    lgc_pause_quantile(s.minor_pause_histogram, 0.99),
+    lgc_pause_quantile(s.pause_histogram, 0.50),
+    lgc_pause_quantile(s.pause_histogram, 0.99),
+  };
+  return lstats_list(6, x);
+}
+
+/* Intern table size and probe lengths
+ * '(symbols slots lookups probes max-probe)
+ */
+static lval* lstats_sym(void) {
+  lsym_stats s;
+  lsym_get_stats(&s);
+  long x[5] = { s.count, s.capacity, s.lookups, s.probes, s.max_probe };
+  return lstats_list(5, x);
+}
+
+/* Evaluation depth and C stack taken by nested runs
+ * '(max-depth max-nested stack-bytes)
+ */
+static lval* lstats_eval(void) {
+  lvm_stats s;
+  lvm_get_stats(&s);
+  long x[3] = { s.max_depth, s.max_nested, s.stack_bytes };
+  return lstats_list(3, x);
+}
+
+/* Nodes folded at compile time
+ * '(runs calls globals)
+ */
+static lval* lstats_fold(void) {
+  lfold_stats s;
+  lfold_get_stats(&s);
+  long x[3] = { s.runs, s.calls, s.globals };
+  return lstats_list(3, x);
+}
+
+/* Native code kept and inline arithmetic bailouts
+ * '(translated bytes refused bailouts)
+ */
+static lval* lstats_jit(void) {
+  ljit_stats s;
+  ljit_get_stats(&s);
+  long x[4] = { s.compiled, s.bytes, s.refused, s.bailouts };
+  return lstats_list(4, x);
+}
+
+/* Parts of the interpreter keeping statistics, by name */
+static const struct {
+  const char* name;
+  void (*print)(void);
+  lval* (*value)(void);         /* what stats returns, () when NULL */
+} lstats_parts[] = {
+  { "gc", lgc_print_stats, lstats_gc },
+  { "pool", lpool_print_stats, NULL },
+  { "sym", lsym_print_stats, lstats_sym },
+  { "eval", lvm_print_stats, lstats_eval },
+  { "fold", lfold_print_stats, lstats_fold },
+  { "jit", ljit_print_stats, lstats_jit },
+};
+
+#define LSTATS_PARTS ((int)(sizeof(lstats_parts) / sizeof(lstats_parts[0])))
+
+/* Print the statistics of the part of the interpreter named by q-expr
+ * A list of one element evaluates to that element, so the part is named
+ * by a quoted symbol rather than by a builtin of no arguments.
+ * list(qexpr) -> list
+ * ('gc) -> '(3 40960 1 4 128 512)
+ *                              major collections, heap bytes, and the
+ *                              p50 and p99 minor and major pauses in us
+ * ('pool) -> ()                occupancy of the allocator size classes
+ * ('sym) -> '(22 256 25 25 1)  intern table symbols, slots, lookups,
+ *                              probes and longest probe
+ * ('eval) -> '(7 4 1008)       most calls pending, most runs nested on
+ *                              the C stack and the bytes they took,
+ *                              with cache misses and tiers printed
+ * ('fold) -> '(2 2 0)          codes folded, calls and globals replaced
+ *                              by their value
+ * ('jit) -> '(2 1536 0 0)      codes translated, bytes of native code
+ *                              kept, codes refused, bailouts
+ */
+lval* builtin_stats(lenv* e, int argc, lval** argv) {
+  LASSERT_NUM("stats", argc, 1);
+  LASSERT_TYPE("stats", argv, 0, LVAL_QEXPR);
+  lval* k = argv[0]->value.qexpr;
+  LASSERT(argv, lval_type(k) == LVAL_SYM,
+    "Function 'stats' passed incorrect type for argument 0. "
+    "Got %s, Expected %s.", ltype_name(lval_type(k)), ltype_name(LVAL_SYM));
+
+  for (int i = 0; i < LSTATS_PARTS; i++) {
+    if (strcmp(k->value.sym, lstats_parts[i].name) == 0) {
+      lstats_parts[i].print();
+      return lstats_parts[i].value ? lstats_parts[i].value() : lval_list();
+    }
+  }
+  return lval_err(LERR_BAD_OP,
+    "Function 'stats' passed unknown part '%s'.", k->value.sym);
+}
+
+/* Print the bytecode q-expr compiles to, once folded
+ * list(qexpr) -> list
+ * ('(+ 1 2)) -> ()
+ */
+lval* builtin_disasm(lenv* e, int argc, lval** argv) {
+  LASSERT_NUM("disasm", argc, 1);
+  LASSERT_TYPE("disasm", argv, 0, LVAL_QEXPR);
+
+  lcode c;
+  lcode_compile(&c, lval_fold(e, lval_qexpr_unquote(argv[0])));
+  lcode_print(&c);
+  lcode_free(&c);
+
+  return lval_list();
+}
+
 /* end of add builtin function*/
 
 
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  
-  /* Ensure all arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    if (a->value.cell[i]->type != LVAL_NUM) {
-      lval_del(a);
+/* Arithmetic
+ * Each operator has its own kernel, with a fast path for two fixnums,
+ * the common case. Longer argument lists fold left. Results that do not
+ * fit a long are an error instead of wrapping around.
+ */
+
+/* Overflow checked long arithmetic, return 1 when *r overflowed */
+#if defined(__GNUC__)
+#define lnum_add_overflow(a, b, r) __builtin_add_overflow(a, b, r)
+#define lnum_sub_overflow(a, b, r) __builtin_sub_overflow(a, b, r)
+#define lnum_mul_overflow(a, b, r) __builtin_mul_overflow(a, b, r)
+#else
+static int lnum_add_overflow(long a, long b, long* r) {
+  if ((b > 0 && a > LONG_MAX - b) || (b < 0 && a < LONG_MIN - b)) {
+    return 1;
+  }
+  *r = a + b;
+  return 0;
+}
+
+static int lnum_sub_overflow(long a, long b, long* r) {
+  if ((b < 0 && a > LONG_MAX + b) || (b > 0 && a < LONG_MIN + b)) {
+    return 1;
+  }
+  *r = a - b;
+  return 0;
+}
+
+static int lnum_mul_overflow(long a, long b, long* r) {
+  if (a > 0 ? (b > 0 ? a > LONG_MAX / b : b < LONG_MIN / a)
+            : (b > 0 ? a < LONG_MIN / b : a != 0 && b < LONG_MAX / a)) {
+    return 1;
+  }
+  *r = a * b;
+  return 0;
+}
+#endif
+
+static lval* lnum_overflow(void) {
+  return lval_err(LERR_BAD_NUM, "Integer overflow");
+}
+
+/* Error unless the argc values of argv are all numbers */
+static lval* lnum_check(int argc, lval** argv) {
+  for (int i = 0; i < argc; i++) {
+    if (lval_type(argv[i]) != LVAL_NUM) {
       return lval_err(LERR_BAD_NUM, "Cannot operate on non-number"); 
     }
   }
-  
-  /* Pop the first element */
-  lval* x = lval_list_pop(a, 0);
-  
-  /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->value.num = -x->value.num;
+  return NULL;
+}
+
+/* Sum the n values of argv into *sum when they are all fixnums
+ * Return 1 on success, 0 when one of them is not a fixnum, -1 when the
+ * sum does not fit a long. The upper and lower 32 bits of the values are
+ * summed apart, so the totals cannot overflow, and the tags are and-ed
+ * together: the loop has no branch and the compiler vectorizes it.
+ */
+static int lnum_sum_fixnums(int n, lval** argv, long* sum) {
+  int64_t hi = 0;
+  int64_t lo = 0;
+  uintptr_t tags = LVAL_FIXNUM_TAG;
+  for (int i = 0; i < n; i++) {
+    tags &= (uintptr_t)argv[i];
+    int64_t x = (int64_t)((intptr_t)argv[i] >> 1);
+    hi += x >> 32;
+    lo += x & 0xffffffff;
   }
-  
-  /* While there are still elements remaining */
-  while (a->count > 0) {
-  
-    /* Pop the next element */
-    lval* y = lval_list_pop(a, 0);
-    
-    /* Perform operation */
-    if (strcmp(op, "+") == 0) { x->value.num += y->value.num; }
-    if (strcmp(op, "-") == 0) { x->value.num -= y->value.num; }
-    if (strcmp(op, "*") == 0) { x->value.num *= y->value.num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->value.num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err(LERR_DIV_ZERO, "Divison by zero"); 
-        break;
-      }
-      x->value.num /= y->value.num;
-    }
-    
-    /* Delete element now finished with */
-    lval_del(y);
+  if (!(tags & LVAL_FIXNUM_TAG)) { return 0; }
+
+  /* sum = hi * 2^32 + lo, with 0 <= lo < 2^32 */
+  hi += lo >> 32;
+  lo &= 0xffffffff;
+  if (hi > (int64_t)(LONG_MAX >> 32) || hi < (int64_t)(LONG_MIN >> 32)) {
+    return -1;
   }
-  
-  /* Delete input expression and return result */
-  lval_del(a);
-  return x;
+  long r = (long)(hi * ((int64_t)1 << 32));
+  if (lnum_add_overflow(r, (long)lo, &r)) { return -1; }
+  *sum = r;
+  return 1;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+/* Sum the n numbers of argv into *sum, return 0 if it overflows */
+static int lnum_sum(int n, lval** argv, long* sum) {
+  int ok = lnum_sum_fixnums(n, argv, sum);
+  if (ok != 0) { return ok > 0; }
+
+  long x = 0;
+  for (int i = 0; i < n; i++) {
+    if (lnum_add_overflow(x, lval_num_value(argv[i]), &x)) { return 0; }
+  }
+  *sum = x;
+  return 1;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+lval* builtin_add(lenv* e, int argc, lval** argv) {
+  if (argc == 2 && lval_is_fixnum(argv[0]) && lval_is_fixnum(argv[1])) {
+    /* Fixnums have a spare bit, so their sum cannot overflow a long */
+    return lval_num(lval_num_value(argv[0]) + lval_num_value(argv[1]));
+  }
+  lval* err = lnum_check(argc, argv);
+  if (err) { return err; }
+
+  long x;
+  if (!lnum_sum(argc, argv, &x)) { return lnum_overflow(); }
+  return lval_num(x);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+lval* builtin_sub(lenv* e, int argc, lval** argv) {
+  if (argc == 2 && lval_is_fixnum(argv[0]) && lval_is_fixnum(argv[1])) {
+    return lval_num(lval_num_value(argv[0]) - lval_num_value(argv[1]));
+  }
+  lval* err = lnum_check(argc, argv);
+  if (err) { return err; }
+
+  /* With a single argument perform unary negation */
+  long x = lval_num_value(argv[0]);
+  long y = 0;
+  if (argc == 1) { y = x; x = 0; }
+  else if (!lnum_sum(argc - 1, &argv[1], &y)) { return lnum_overflow(); }
+
+  if (lnum_sub_overflow(x, y, &x)) { return lnum_overflow(); }
+  return lval_num(x);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+lval* builtin_mul(lenv* e, int argc, lval** argv) {
+  lval* err = lnum_check(argc, argv);
+  if (err) { return err; }
+
+  long x = lval_num_value(argv[0]);
+  for (int i = 1; i < argc; i++) {
+    if (lnum_mul_overflow(x, lval_num_value(argv[i]), &x)) {
+      return lnum_overflow();
+    }
+  }
+  return lval_num(x);
+}
+
+lval* builtin_div(lenv* e, int argc, lval** argv) {
+  lval* err = lnum_check(argc, argv);
+  if (err) { return err; }
+
+  long x = lval_num_value(argv[0]);
+  for (int i = 1; i < argc; i++) {
+    long n = lval_num_value(argv[i]);
+    if (n == 0) {
+      return lval_err(LERR_DIV_ZERO, "Divison by zero"); 
+    }
+    if (n == -1 && x == LONG_MIN) { return lnum_overflow(); }
+    x /= n;
+  }
+  return lval_num(x);
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
   lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+}
+
+/* Add a builtin without side effects, calls of it may be folded */
+void lenv_add_pure_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  v->flags |= LVAL_F_PURE;
+  lenv_put(e, k, v);
 }
 
 void lenv_add_builtins(lenv* e) {
   /* Variable Function */
   lenv_add_builtin(e, "def", builtin_def);
   /* List Functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_pure_builtin(e, "list", builtin_list);
+  lenv_add_pure_builtin(e, "head", builtin_head);
+  lenv_add_pure_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_qexpr_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_pure_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "disasm", builtin_disasm);
 
   /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_pure_builtin(e, "+", builtin_add);
+  lenv_add_pure_builtin(e, "-", builtin_sub);
+  lenv_add_pure_builtin(e, "*", builtin_mul);
+  lenv_add_pure_builtin(e, "/", builtin_div);
+
+  /* Collector Functions */
+  lenv_add_builtin(e, "gc-budget", builtin_gc_budget);
+
+  /* Statistics Functions */
+  lenv_add_builtin(e, "stats", builtin_stats);
 }
 
-lval* lval_eval_list(lenv* e, lval* v) {
-  
-  /* Evaluate Children */
-  for (int i = 0; i < v->count; i++) {
-    v->value.cell[i] = lval_eval(e, v->value.cell[i]);
+/* Evaluation stack of the tree walker
+ * A list being evaluated has a frame here instead of a C stack frame.
+ * The list, then its elements as they are evaluated, are kept above
+ * base on a value stack that is a collector root.
+ */
+typedef struct leval_frame {
+  lenv* e;
+  int base;             /* position of the list on the value stack */
+  int next;             /* element being evaluated */
+  int form;             /* kind of special form, see lform.h, or 0 */
+  int sub;              /* element of the cond clause at next, or for
+                           a loop, set once its frame is entered */
+} leval_frame;
+
+static leval_frame* leval_frames = NULL;
+static int leval_fp = 0;
+static int leval_frames_capacity = 0;
+
+static lval** leval_values = NULL;
+static int leval_sp = 0;
+static int leval_capacity = 0;
+
+/* Push x on the value stack */
+static void leval_push(lval* x) {
+  if (leval_values == NULL) { lgc_add_range(&leval_values, &leval_sp); }
+  if (leval_sp == leval_capacity) {
+    leval_capacity = leval_capacity ? leval_capacity * 2 : 256;
+    leval_values = realloc(leval_values, sizeof(lval*) * leval_capacity);
   }
-  
-  /* Error Checking */
-  for (int i = 0; i < v->count; i++) {
-    if (v->value.cell[i]->type == LVAL_ERR) { return lval_list_take(v, i); }
+  leval_values[leval_sp++] = x;
+}
+
+/* Push a frame evaluating list v in e */
+static void leval_push_frame(lenv* e, lval* v) {
+  if (leval_fp == leval_frames_capacity) {
+    leval_frames_capacity = leval_frames_capacity ?
+      leval_frames_capacity * 2 : 64;
+    leval_frames = realloc(leval_frames,
+                           sizeof(leval_frame) * leval_frames_capacity);
   }
-  
-  /* Empty Expression */
-  if (v->count == 0) { return v; }
-  
-  /* Single Expression */
-  if (v->count == 1) { return lval_list_take(v, 0); }
-  
+  leval_frame* f = &leval_frames[leval_fp++];
+  f->e = e;
+  f->base = leval_sp;
+  f->next = 0;
+  f->form = LFORM_NONE;
+  f->sub = 0;
+  leval_push(v);
+}
+
+/* Call the function of the innermost frame, all of its elements evaluated
+ * None of them is an error, see leval_unwind.
+ */
+static lval* leval_call(void) {
+  leval_frame* f = &leval_frames[leval_fp - 1];
+  lval** vals = &leval_values[f->base];
+  lval* fun = vals[1];
+  int n = leval_sp - f->base - 2;
+
   /* Ensure First Element is Function */
-  lval* f = lval_list_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval_del(f); lval_del(v);
-    return lval_err(LERR_BAD_LIST, "List does not start with symbol"); 
+  if (lval_type(fun) != LVAL_FUN) { return &lerr_not_function; }
+
+  /* The arguments are passed in place, they stay on the stack */
+  return fun->value.fun.call(f->e, n, &vals[2]);
+}
+
+/* Specialized nodes
+ * The first time the tree walker evaluates a call it records what kind
+ * of node it is in the flags of its list, and evaluates it according to
+ * that kind from then on:
+ *
+ *   LNODE_GENERIC   evaluated from the frames of the evaluation stack
+ *   LNODE_CALL      a function and arguments that are all leaves,
+ *                   constants and variables, looked up and called in
+ *                   place without a frame
+ *   LNODE_ADD2      (+ a b) of leaves found to be fixnums, added in place
+ *   LNODE_SUB2      (- a b) likewise
+ *   LNODE_FORM      a special form, evaluated from a frame of its own
+ *
+ * The arithmetic kinds guard their function and operands, and fall back
+ * to LNODE_CALL for good once either changes type. The kind only depends
+ * on the shape of the list otherwise, so lists shared or copied keep a
+ * valid one.
+ */
+enum { LNODE_NONE, LNODE_GENERIC, LNODE_CALL, LNODE_ADD2, LNODE_SUB2,
+       LNODE_FORM };
+
+#define LNODE_MAX_ARGS 8
+
+static int lnode_kind(lval* v) {
+  return (v->flags & LVAL_F_NODE) >> LVAL_F_NODE_SHIFT;
+}
+
+static void lnode_set_kind(lval* v, int kind) {
+  v->flags = (v->flags & ~LVAL_F_NODE) | (kind << LVAL_F_NODE_SHIFT);
+}
+
+/* Kind of call v before it is first evaluated */
+static int lnode_classify(lval* v) {
+  if (lform_kind(v) != LFORM_NONE) { return LNODE_FORM; }
+  if (v->count - 1 > LNODE_MAX_ARGS) { return LNODE_GENERIC; }
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->value.cell[i];
+    if (lval_type(x) == LVAL_LIST && x->count > 0) { return LNODE_GENERIC; }
   }
-  
-  /* Call builtin with operator */
-  lval* result = f->value.fun(e, v);
-  lval_del(f);
-  return result;
+  return LNODE_CALL;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
+/* Value of leaf x in e */
+static lval* lnode_leaf(lenv* e, lval* x) {
+  switch (lval_type(x)) {
+    case LVAL_SYM: return lenv_get(e, x);
+    case LVAL_REF: return lenv_get_ref(e, x);
+    default: return x;
+  }
+}
 
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* Evaluate call v in e according to its kind
+ * Return NULL when v must be evaluated from the evaluation stack. Leaves
+ * never reach a safepoint, so their values need no rooting.
+ */
+static lval* lnode_eval(lenv* e, lval* v) {
+  int kind = lnode_kind(v);
+  int first = kind == LNODE_NONE;
+  if (first) {
+    kind = lnode_classify(v);
+    lnode_set_kind(v, kind);
+  }
+  if (kind == LNODE_GENERIC || kind == LNODE_FORM) { return NULL; }
+
+  /* The function is kept below its arguments, as builtins expect */
+  lval* vals[LNODE_MAX_ARGS + 1];
+  int n = v->count - 1;
+  for (int i = 0; i <= n; i++) { vals[i] = lnode_leaf(e, v->value.cell[i]); }
+  lval* fun = vals[0];
+
+  /* Done inline, the call still counts against the depth limit */
+  if (kind == LNODE_ADD2 || kind == LNODE_SUB2) {
+    if (lval_is_fixnum(vals[1]) && lval_is_fixnum(vals[2])
+        && lval_type(fun) == LVAL_FUN && lvm_push_depth(1)) {
+      lvm_pop_depth(1);
+      long x = lval_num_value(vals[1]);
+      long y = lval_num_value(vals[2]);
+      if (kind == LNODE_ADD2 && fun->value.fun.call == builtin_add) {
+        return lval_num(x + y);
+      }
+      if (kind == LNODE_SUB2 && fun->value.fun.call == builtin_sub) {
+        return lval_num(x - y);
+      }
+    }
+    lnode_set_kind(v, LNODE_CALL);
+  }
+
+  /* Error Checking, the first error found in order ends the call */
+  for (int i = 0; i <= n; i++) {
+    if (lval_type(vals[i]) == LVAL_ERR) { return vals[i]; }
+  }
+  if (lval_type(fun) != LVAL_FUN) { return &lerr_not_function; }
+
+  /* Specialize arithmetic on the operands seen by the first evaluation */
+  if (first && n == 2 && lval_is_fixnum(vals[1]) && lval_is_fixnum(vals[2])) {
+    if (fun->value.fun.call == builtin_add) { lnode_set_kind(v, LNODE_ADD2); }
+    if (fun->value.fun.call == builtin_sub) { lnode_set_kind(v, LNODE_SUB2); }
   }
 
-  /* Evaluate List */
-  if (v->type == LVAL_LIST) { return lval_eval_list(e, v); }
-  /* All other lval types remain the same */
-  return v;
+  /* Past the depth limit the evaluation stack reports the error */
+  if (!lvm_push_depth(1)) { return NULL; }
+  lval* r = fun->value.fun.call(e, n, &vals[1]);
+  lvm_pop_depth(1);
+  return r;
 }
 
+/* Special forms
+ * A form is evaluated from a frame like a call, but the frame picks the
+ * operands to evaluate one at a time from the values of the previous
+ * ones, and none of them is pushed on the value stack.
+ */
 
+/* Continue the form of frame f, given the value *r of the operand it
+ * evaluated last, or start it when next is 0
+ * Return the operand to evaluate next, with *tail set when its value is
+ * the value of the form, or NULL once *r is the value of the form.
+ */
+static lval* leval_form_next(leval_frame* f, lval** r, int* tail) {
+  lval* l = leval_values[f->base];
+  lval** x = l->value.cell;
+  int n = l->count;
+  int i = f->next;
+
+  *tail = 0;
+  switch (f->form) {
+    case LFORM_IF:
+      if (i == 0) {
+        f->next = 1;
+        return x[1];
+      }
+      *tail = 1;
+      if (!lval_is_false(*r)) { return x[2]; }
+      if (n == 4) { return x[3]; }
+      *r = lval_list();
+      return NULL;
+
+    case LFORM_WHEN:
+      if (i == 0) {
+        f->next = 1;
+        return x[1];
+      }
+      if (i == 1 && (n == 2 || lval_is_false(*r))) {
+        *r = lval_list();
+        return NULL;
+      }
+      break;
 
+    case LFORM_AND:
+    case LFORM_OR:
+      if (i > 0 && lval_is_false(*r) == (f->form == LFORM_AND)) {
+        return NULL;
+      }
+      break;
+
+    case LFORM_COND: {
+      if (i == 0) {
+        f->next = 1;
+        f->sub = 0;
+        return x[1]->value.cell[0];
+      }
+      lval* c = x[i];
+      if (f->sub == 0) {
+        if (lval_is_false(*r)) {
+          if (++f->next == n) {
+            *r = lval_list();
+            return NULL;
+          }
+          return x[f->next]->value.cell[0];
+        }
+        if (c->count == 1) { return NULL; }
+      }
+      f->sub++;
+      *tail = f->sub == c->count - 1;
+      return c->value.cell[f->sub];
+    }
+
+    /* The test is evaluated again after the last body */
+    case LFORM_WHILE:
+      if (i == 1 && lval_is_false(*r)) {
+        *r = lval_list();
+        return NULL;
+      }
+      f->next = i + 1 < n ? i + 1 : 1;
+      return x[f->next];
+
+    case LFORM_DOTIMES:
+    case LFORM_FOREACH:
+      if (i == 0) {
+        f->next = 1;
+        return x[1]->value.cell[1];
+      }
+      if (i == 1) {
+        *r = lform_enter(f->e, f->form, lform_var(l), *r);
+        if (*r) { return NULL; }
+        f->sub = 1;
+      }
+      if (i + 1 < n) {
+        f->next = i + 1;
+        return x[f->next];
+      }
+
+      /* The last body is done, the bodies run again for the next value */
+      while (lform_step(f->e, f->form)) {
+        if (n > 2) {
+          f->next = 2;
+          return x[2];
+        }
+      }
+      lframe_leave(f->e);
+      *r = lval_list();
+      return NULL;
+  }
+
+  /* The operands of the other forms are evaluated in turn */
+  f->next = i + 1;
+  *tail = f->next == n - 1;
+  return x[f->next];
+}
+
+/* Drop the frames of the evaluation stack above bottom, and the local
+ * frames of the loops among them
+ * An error ends every list being evaluated: none of them can use it other
+ * than as its own value, so the values left to evaluate are skipped.
+ */
+static void leval_unwind(int bottom) {
+  while (leval_fp > bottom) {
+    leval_frame* f = &leval_frames[--leval_fp];
+    if (f->sub && (f->form == LFORM_DOTIMES || f->form == LFORM_FOREACH)) {
+      lframe_leave(f->e);
+    }
+    leval_sp = f->base;
+    lvm_pop_depth(1);
+  }
+}
+
+/* Evaluate v by walking it
+ * Lists are evaluated from the frames of the evaluation stack rather than
+ * by recursion, and tail evaluations returned by builtins replace the
+ * call that returned them, so neither deep code nor long chains of tail
+ * calls grow the C stack. With tails set, a tail evaluation replacing v
+ * as a whole is returned as LVM_TAIL instead, for the caller to run.
+ */
+static lval* leval_walk(lenv* e, lval* v, int tails) {
+  int bottom = leval_fp;
+  lval* r;
+
+  for (;;) {
+    /* Collect if due, keeping v alive */
+    int roots = lgc_root_height();
+    lgc_push_root(&v);
+    lgc_safepoint();
+    lgc_pop_roots(roots);
+
+    /* Single Expression */
+    while (lval_type(v) == LVAL_LIST && v->count == 1) { v = v->value.cell[0]; }
+
+    switch (lval_type(v)) {
+      case LVAL_SYM: r = lenv_get(e, v); break;
+
+      /* Resolved symbols are found by index */
+      case LVAL_REF: r = lenv_get_ref(e, v); break;
+
+      /* Evaluate the elements of a list first, the empty list is itself */
+      case LVAL_LIST:
+        if (v->count == 0) { r = v; break; }
+        r = lnode_eval(e, v);
+        if (r == LVM_TAIL) {
+          if (tails && leval_fp == bottom) { return r; }
+          v = lvm_take_tail(&e);
+          continue;
+        }
+        if (r) { break; }
+        if (lnode_kind(v) == LNODE_FORM) {
+          int form = lform_kind(v);
+          r = lform_check(v, form);
+          if (r) { break; }
+          if (!lvm_push_depth(1)) { r = lvm_depth_error(); break; }
+          leval_push_frame(e, v);
+          leval_frames[leval_fp - 1].form = form;
+          break;
+        }
+        if (!lvm_push_depth(1)) { r = lvm_depth_error(); break; }
+        leval_push_frame(e, v);
+        v = v->value.cell[0];
+        continue;
+
+      /* All other lval types remain the same */
+      default: r = v; break;
+    }
+
+    /* Hand r to the frame waiting for it, calling it once complete */
+    for (;;) {
+      if (leval_fp == bottom) { return r; }
+      /* An error ends the evaluation, r is NULL as a form starts */
+      if (r && lval_type(r) == LVAL_ERR) {
+        leval_unwind(bottom);
+        return r;
+      }
 
+      /* A form goes on with its next operand, or ends */
+      leval_frame* f = &leval_frames[leval_fp - 1];
+      if (f->form) {
+        int tail;
+        lval* x = leval_form_next(f, &r, &tail);
+        e = f->e;
+        if (x && !tail) {
+          v = x;
+          break;
+        }
+        leval_sp = f->base;
+        leval_fp--;
+        lvm_pop_depth(1);
+        if (x) {
+          v = x;
+          break;
+        }
+        continue;
+      }
 
+      leval_push(r);
+      lval* l = leval_values[f->base];
+      if (++f->next < l->count) {
+        e = f->e;
+        v = l->value.cell[f->next];
+        break;
+      }
+
+      r = leval_call();
+      leval_sp = leval_frames[--leval_fp].base;
+      lvm_pop_depth(1);
+
+      /* A tail evaluation is done in place of the call */
+      if (r == LVM_TAIL) {
+        if (tails && leval_fp == bottom) { return r; }
+        v = lvm_take_tail(&e);
+        break;
+      }
+    }
+  }
+}
+
+/* Evaluate v by walking it */
+lval* lval_eval_tree(lenv* e, lval* v) {
+  return leval_walk(e, v, 0);
+}
+
+/* Evaluate v by walking it, may return LVM_TAIL for the VM to run */
+lval* lval_eval_tree_step(lenv* e, lval* v) {
+  return leval_walk(e, v, 1);
+}
+
+/* Evaluate v, with the bytecode VM unless the tree walker is selected */
+lval* lval_eval(lenv* e, lval* v) {
+  if (lvm_engine == LVM_ENGINE_TREE) { return lval_eval_tree(e, v); }
+  return lvm_eval(e, v);
+}
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lalloc.h"
+
+#define LPOOL_SLAB_SIZE (64 * 1024)
+#define LPOOL_BATCH     64                  /* blocks moved to/from depot */
+#define LPOOL_CACHE_MAX (4 * LPOOL_BATCH)   /* free blocks a thread keeps */
+
+static const size_t lpool_sizes[LPOOL_CLASSES] = {
+  sizeof(lval),
+  1 * sizeof(lval*), 2 * sizeof(lval*), 4 * sizeof(lval*),
+  8 * sizeof(lval*), 16 * sizeof(lval*), 32 * sizeof(lval*),
+  64 * sizeof(lval*)
+};
+
+/* Number of cells a cell array holding n cells has room for */
+static int lcells_capacity(int n) {
+  int cap = 1;
+  while (cap < n) { cap <<= 1; }
+  return cap;
+}
+
+/* Size class of a cell array holding n cells, -1 if it is too big */
+static int lcells_class(int n) {
+  int c = LPOOL_CELLS_1;
+  for (int cap = 1; cap < n; cap <<= 1) { c++; }
+  return c < LPOOL_CLASSES ? c : -1;
+}
+
+/* Count of cell arrays too big for the pool */
+static long lpool_large = 0;
+
+/* Bytes held by values outside of any arena, for the collector
+ * The collector is global, so this is one count for the whole process.
+ */
+static size_t lheap_held = 0;
+
+#if defined(LVAL_POOL_MALLOC)
+
+static void* lpool_get(int c) { return malloc(lpool_sizes[c]); }
+static void lpool_put(int c, void* p) { free(p); }
+
+void lpool_get_stats(lpool_stats* s) {
+  memset(s, 0, sizeof(lpool_stats));
+  for (int c = 0; c < LPOOL_CLASSES; c++) {
+    s->cls[c].size = lpool_sizes[c];
+  }
+  s->large = lpool_large;
+}
+
+#else
+
+/* A free block, linked through its first word */
+typedef struct lblock {
+  struct lblock* next;
+} lblock;
+
+/* Per thread cache of free blocks */
+typedef struct lpool_cache {
+  lblock* free[LPOOL_CLASSES];
+  long count[LPOOL_CLASSES];
+  struct lpool_cache* next;
+} lpool_cache;
+
+/* Shared depot, guarded by lock */
+static struct {
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  lblock* free[LPOOL_CLASSES];
+  long count[LPOOL_CLASSES];
+  long slabs[LPOOL_CLASSES];
+  lpool_cache* caches;
+} lpool_depot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+static __thread lpool_cache* lpool_local = NULL;
+
+/* Give all blocks of an exiting thread back to the depot */
+static void lpool_cache_release(void* p) {
+  lpool_cache* t = p;
+
+  pthread_mutex_lock(&lpool_depot.lock);
+  for (int c = 0; c < LPOOL_CLASSES; c++) {
+    while (t->free[c]) {
+      lblock* b = t->free[c];
+      t->free[c] = b->next;
+      b->next = lpool_depot.free[c];
+      lpool_depot.free[c] = b;
+      lpool_depot.count[c]++;
+    }
+  }
+  lpool_cache** pp = &lpool_depot.caches;
+  while (*pp != t) { pp = &(*pp)->next; }
+  *pp = t->next;
+  pthread_mutex_unlock(&lpool_depot.lock);
+
+  free(t);
+}
+
+static void lpool_init(void) {
+  pthread_key_create(&lpool_depot.key, lpool_cache_release);
+}
+
+/* Create and register the cache of the calling thread */
+static lpool_cache* lpool_cache_new(void) {
+  pthread_once(&lpool_once, lpool_init);
+
+  lpool_cache* t = calloc(1, sizeof(lpool_cache));
+  pthread_setspecific(lpool_depot.key, t);
+
+  pthread_mutex_lock(&lpool_depot.lock);
+  t->next = lpool_depot.caches;
+  lpool_depot.caches = t;
+  pthread_mutex_unlock(&lpool_depot.lock);
+
+  lpool_local = t;
+  return t;
+}
+
+/* Carve a new slab into free blocks of class c, depot lock held */
+static void lpool_carve(int c) {
+  size_t size = lpool_sizes[c];
+  char* slab = malloc(LPOOL_SLAB_SIZE);
+  if (slab == NULL) {
+    perror("lispy: out of memory");
+    exit(1);
+  }
+
+  for (size_t off = 0; off + size <= LPOOL_SLAB_SIZE; off += size) {
+    lblock* b = (lblock*)(slab + off);
+    b->next = lpool_depot.free[c];
+    lpool_depot.free[c] = b;
+    lpool_depot.count[c]++;
+  }
+  lpool_depot.slabs[c]++;
+}
+
+/* Move a batch of class c blocks from the depot into cache t */
+static void lpool_refill(lpool_cache* t, int c) {
+  pthread_mutex_lock(&lpool_depot.lock);
+  if (lpool_depot.free[c] == NULL) { lpool_carve(c); }
+
+  for (int i = 0; i < LPOOL_BATCH && lpool_depot.free[c]; i++) {
+    lblock* b = lpool_depot.free[c];
+    lpool_depot.free[c] = b->next;
+    lpool_depot.count[c]--;
+    b->next = t->free[c];
+    t->free[c] = b;
+    t->count[c]++;
+  }
+  pthread_mutex_unlock(&lpool_depot.lock);
+}
+
+/* Move a batch of class c blocks from cache t back to the depot */
+static void lpool_flush(lpool_cache* t, int c) {
+  pthread_mutex_lock(&lpool_depot.lock);
+  for (int i = 0; i < LPOOL_BATCH; i++) {
+    lblock* b = t->free[c];
+    t->free[c] = b->next;
+    t->count[c]--;
+    b->next = lpool_depot.free[c];
+    lpool_depot.free[c] = b;
+    lpool_depot.count[c]++;
+  }
+  pthread_mutex_unlock(&lpool_depot.lock);
+}
+
+/* Take a block of class c */
+static void* lpool_get(int c) {
+  lpool_cache* t = lpool_local ? lpool_local : lpool_cache_new();
+  if (t->free[c] == NULL) { lpool_refill(t, c); }
+
+  lblock* b = t->free[c];
+  t->free[c] = b->next;
+  t->count[c]--;
+  return b;
+}
+
+/* Give back a block of class c */
+static void lpool_put(int c, void* p) {
+  lpool_cache* t = lpool_local ? lpool_local : lpool_cache_new();
+  lblock* b = p;
+  b->next = t->free[c];
+  t->free[c] = b;
+  t->count[c]++;
+
+  if (t->count[c] > LPOOL_CACHE_MAX) { lpool_flush(t, c); }
+}
+
+void lpool_get_stats(lpool_stats* s) {
+  memset(s, 0, sizeof(lpool_stats));
+
+  pthread_mutex_lock(&lpool_depot.lock);
+  for (int c = 0; c < LPOOL_CLASSES; c++) {
+    lpool_class_stats* k = &s->cls[c];
+    k->size   = lpool_sizes[c];
+    k->slabs  = lpool_depot.slabs[c];
+    k->blocks = k->slabs * (LPOOL_SLAB_SIZE / k->size);
+    k->depot  = lpool_depot.count[c];
+    /* Other threads' counts are read without their cooperation */
+    for (lpool_cache* t = lpool_depot.caches; t; t = t->next) {
+      k->cached += t->count[c];
+    }
+    k->in_use = k->blocks - k->depot - k->cached;
+  }
+  pthread_mutex_unlock(&lpool_depot.lock);
+
+  s->large = lpool_large;
+}
+
+#endif
+
+
+/* Evaluation arenas */
+
+#define LARENA_CHUNK_SIZE (64 * 1024)
+#define LARENA_ALIGN      sizeof(void*)
+
+struct larena_chunk {
+  struct larena_chunk* next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+static __thread larena* larena_current = NULL;
+
+/* Bump-allocate n bytes from arena a */
+static void* larena_alloc(larena* a, size_t n) {
+  n = (n + LARENA_ALIGN - 1) & ~(size_t)(LARENA_ALIGN - 1);
+  a->bytes += n;
+
+  larena_chunk* k = a->chunks;
+  if (k == NULL || k->size - k->used < n) {
+    size_t size = n > LARENA_CHUNK_SIZE ? n : LARENA_CHUNK_SIZE;
+    k = malloc(sizeof(larena_chunk) + size);
+    if (k == NULL) {
+      perror("lispy: out of memory");
+      exit(1);
+    }
+    k->size = size;
+    k->used = 0;
+    k->next = a->chunks;
+    a->chunks = k;
+  }
+
+  void* p = k->data + k->used;
+  k->used += n;
+  return p;
+}
+
+/* Make a the current arena */
+void larena_begin(larena* a) {
+#if !defined(LVAL_POOL_MALLOC)
+  larena_current = a;
+#endif
+}
+
+/* Release everything allocated in a
+ * The last chunk is kept, so the next evaluation does not have to go
+ * back to malloc for small inputs.
+ */
+void larena_end(larena* a) {
+  if (larena_current == a) { larena_current = NULL; }
+
+  larena_chunk* k = a->chunks;
+  if (k == NULL) { return; }
+#if defined(LARENA_DEBUG)
+  /* Keep nothing, so sanitizers catch values used after the reset */
+  a->chunks = NULL;
+  a->bytes = 0;
+  while (k) {
+    larena_chunk* n = k->next;
+    free(k);
+    k = n;
+  }
+  return;
+#endif
+  while (k->next) {
+    larena_chunk* n = k->next;
+    k->next = n->next;
+    free(n);
+  }
+  k->used = 0;
+  a->bytes = 0;
+}
+
+/* Make a the current arena, return the previous one */
+larena* larena_swap(larena* a) {
+  larena* p = larena_current;
+#if !defined(LVAL_POOL_MALLOC)
+  larena_current = a;
+#endif
+  return p;
+}
+
+
+/* Allocate an lval struct */
+lval* lval_alloc(void) {
+  lval* v;
+  if (larena_current) {
+    v = larena_alloc(larena_current, sizeof(lval));
+    v->flags = LVAL_F_ARENA;
+  } else {
+    v = lpool_get(LPOOL_LVAL);
+    v->flags = 0;
+    lheap_held += sizeof(lval);
+  }
+  v->mark = 0;
+  return v;
+}
+
+/* Return an lval struct to the pool */
+void lval_free(lval* v) {
+  if (v->flags & LVAL_F_ARENA) { return; }
+  lheap_held -= sizeof(lval);
+  lpool_put(LPOOL_LVAL, v);
+}
+
+/* Allocate a cell array for list v able to hold n cells */
+lval** lcells_alloc(const lval* v, int n) {
+  if (n <= 0) { return NULL; }
+
+  if (v->flags & LVAL_F_ARENA) {
+    return larena_alloc(larena_current, sizeof(lval*) * lcells_capacity(n));
+  }
+
+  lheap_held += sizeof(lval*) * lcells_capacity(n);
+  int c = lcells_class(n);
+  if (c < 0) {
+    __sync_fetch_and_add(&lpool_large, 1);
+    return malloc(sizeof(lval*) * lcells_capacity(n));
+  }
+  return lpool_get(c);
+}
+
+/* Free cell array c of list v currently holding n cells */
+void lcells_free(const lval* v, lval** c, int n) {
+  if (c == NULL || (v->flags & LVAL_F_ARENA)) { return; }
+
+  lheap_held -= sizeof(lval*) * lcells_capacity(n);
+  int k = lcells_class(n);
+  if (k < 0) {
+    __sync_fetch_and_sub(&lpool_large, 1);
+    free(c);
+    return;
+  }
+  lpool_put(k, c);
+}
+
+/* Resize cell array c of list v from n to m cells
+ * Only moves the cells when the capacity class changes.
+ */
+lval** lcells_resize(const lval* v, lval** c, int n, int m) {
+  if (n <= 0) { return lcells_alloc(v, m); }
+  if (m <= 0) { lcells_free(v, c, n); return NULL; }
+
+  int cap = lcells_capacity(n);
+  if (cap == lcells_capacity(m)) { return c; }
+
+  /* Both too big for the pool, let realloc try to grow in place */
+  if (!(v->flags & LVAL_F_ARENA)
+      && lcells_class(n) < 0 && lcells_class(m) < 0) {
+    lheap_held += sizeof(lval*) * (lcells_capacity(m) - cap);
+    return realloc(c, sizeof(lval*) * lcells_capacity(m));
+  }
+
+  lval** d = lcells_alloc(v, m);
+  memcpy(d, c, sizeof(lval*) * (n < m ? n : m));
+  lcells_free(v, c, n);
+  return d;
+}
+
+/* Allocate n bytes of string data for v */
+char* lstr_alloc(const lval* v, size_t n) {
+  if (v->flags & LVAL_F_ARENA) {
+    return larena_alloc(larena_current, n);
+  }
+  lheap_held += n;
+  return malloc(n);
+}
+
+/* Free string data s of v */
+void lstr_free(const lval* v, char* s) {
+  if (v->flags & LVAL_F_ARENA) { return; }
+  lheap_held -= strlen(s) + 1;
+  free(s);
+}
+
+/* Bytes currently held by values outside of any arena */
+size_t lheap_bytes(void) {
+  return lheap_held;
+}
+
+/* Print the current pool occupancy */
+void lpool_print_stats(void) {
+  lpool_stats s;
+  lpool_get_stats(&s);
+
+  printf("%6s %8s %8s %10s %10s %10s %10s\n",
+    "class", "size", "slabs", "blocks", "in use", "cached", "depot");
+  for (int c = 0; c < LPOOL_CLASSES; c++) {
+    lpool_class_stats* k = &s.cls[c];
+    printf("%6i %8zu %8li %10li %10li %10li %10li\n",
+      c, k->size, k->slabs, k->blocks, k->in_use, k->cached, k->depot);
+  }
+  printf("large cell arrays: %li\n", s.large);
+}
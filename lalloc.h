@@ -0,0 +1,104 @@
+#if !defined(__LALLOC_H__)
+#define __LALLOC_H__
+
+#include <stddef.h>
+#include "lval.h"
+
+/* Pool allocator for lval structs and cell arrays
+ *
+ * Blocks come from fixed size classes carved out of large slabs. Each
+ * thread keeps a small cache of free blocks per class and only takes the
+ * depot lock to move a whole batch of blocks in or out.
+ *
+ * The pools are thread safe, the collected heap is not: the values the
+ * collector tracks (see lgc.h) are all allocated and freed by the one
+ * thread evaluating, and lheap_bytes counts them for the whole process.
+ *
+ * Cell arrays are sized by power of two classes, so the capacity of a
+ * "lval**" array is always derived from its count and does not need to
+ * be stored.
+ *
+ * Build with -DLVAL_POOL_MALLOC to use plain malloc/free instead, e.g.
+ * when running under a sanitizer. This also turns arenas off.
+ */
+
+/* Size classes: one for lval structs, then cell arrays of 1..64 cells */
+enum { LPOOL_LVAL, LPOOL_CELLS_1, LPOOL_CELLS_2, LPOOL_CELLS_4,
+       LPOOL_CELLS_8, LPOOL_CELLS_16, LPOOL_CELLS_32, LPOOL_CELLS_64,
+       LPOOL_CLASSES };
+
+/* Occupancy of one size class */
+typedef struct lpool_class_stats {
+  size_t size;      /* bytes per block */
+  long slabs;       /* slabs carved for this class */
+  long blocks;      /* blocks in all slabs */
+  long in_use;      /* blocks handed out */
+  long cached;      /* free blocks in thread caches */
+  long depot;       /* free blocks in the shared depot */
+} lpool_class_stats;
+
+typedef struct lpool_stats {
+  lpool_class_stats cls[LPOOL_CLASSES];
+  long large;       /* cell arrays too big for any class */
+} lpool_stats;
+
+/* Allocate an lval struct, only flags and mark are initialised */
+lval* lval_alloc(void);
+
+/* Return an lval struct to the pool */
+void lval_free(lval* v);
+
+/* Allocate a cell array for list v able to hold n cells (NULL if 0) */
+lval** lcells_alloc(const lval* v, int n);
+
+/* Resize cell array c of list v from n to m cells, keeping the first cells */
+lval** lcells_resize(const lval* v, lval** c, int n, int m);
+
+/* Free cell array c of list v currently holding n cells */
+void lcells_free(const lval* v, lval** c, int n);
+
+/* Allocate n bytes of string data for v */
+char* lstr_alloc(const lval* v, size_t n);
+
+/* Free string data s of v */
+void lstr_free(const lval* v, char* s);
+
+/* Bytes currently held by values outside of any arena */
+size_t lheap_bytes(void);
+
+/* Fill s with the current pool occupancy */
+void lpool_get_stats(lpool_stats* s);
+
+/* Print the current pool occupancy */
+void lpool_print_stats(void);
+
+
+/* Evaluation arenas
+ *
+ * While an arena is current, lval_alloc() and the cell and string
+ * allocators of the values it returns bump-allocate from the arena
+ * instead of the pool, and mark the value with LVAL_F_ARENA. The
+ * collector does not track such values: everything in the arena is
+ * released in one go by larena_end(). Values that must outlive the arena
+ * have to be copied with the arena switched off (see lval_promote).
+ * The collector uses an arena as its nursery (see lgc.h).
+ * Build with -DLARENA_DEBUG to give all arena memory back to malloc on
+ * larena_end(), so sanitizers catch values used after it.
+ */
+typedef struct larena_chunk larena_chunk;
+
+typedef struct larena {
+  larena_chunk* chunks;
+  size_t bytes;     /* bytes handed out since larena_begin */
+} larena;
+
+/* Make a the current arena */
+void larena_begin(larena* a);
+
+/* Release everything allocated in a and make no arena current */
+void larena_end(larena* a);
+
+/* Make a the current arena (NULL for none), return the previous one */
+larena* larena_swap(larena* a);
+
+#endif
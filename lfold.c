@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lfold.h"
+#include "lgc.h"
+#include "lform.h"
+
+static lfold_stats lfold;
+
+/* List whose elements are being folded */
+typedef struct lfold_frame {
+  lval* v;
+  lval* copy;           /* copy of v once an element changed, else NULL */
+  int next;             /* element being folded */
+  int literal;          /* its arguments folded so far are all literals */
+} lfold_frame;
+
+static lfold_frame* lfold_frames = NULL;
+static int lfold_frames_capacity = 0;
+
+/* Function then arguments of a call being folded */
+static lval** lfold_args = NULL;
+static int lfold_args_capacity = 0;
+
+/* Check whether x evaluates to itself and may be folded into code */
+static int lfold_is_literal(lval* x) {
+  int t = lval_type(x);
+  return t == LVAL_NUM || t == LVAL_QEXPR;
+}
+
+/* Value of global x in e, NULL unless it is bound and never redefined */
+static lval* lfold_global(lenv* e, lval* x) {
+  lval* k;
+  switch (lval_type(x)) {
+    case LVAL_SYM: k = x; break;
+    case LVAL_REF:
+      if (x->value.ref.depth >= 0) { return NULL; }
+      k = x->value.ref.sym;
+      break;
+    default: return NULL;
+  }
+
+  /* A frame may bind k in place of its global binding */
+  if (k->flags & LVAL_F_LOCAL) { return NULL; }
+
+  int i = lenv_index(e, k);
+  if (i < 0 || e->vars[i].redefined) { return NULL; }
+  return e->vars[i].val;
+}
+
+/* Fold list l, its elements already folded
+ * Set *stop when l is a call that cannot be folded: it may change
+ * bindings once evaluated.
+ */
+static lval* lfold_list(lenv* e, lval* l, int literal, int* stop) {
+
+  /* Single element lists evaluate to their element */
+  if (l->count == 1) {
+    return lfold_is_literal(l->value.cell[0]) ? l->value.cell[0] : l;
+  }
+  if (*stop) { return l; }
+
+  lval* f = lfold_global(e, l->value.cell[0]);
+  if (f == NULL || lval_type(f) != LVAL_FUN || !(f->flags & LVAL_F_PURE)) {
+    *stop = 1;
+    return l;
+  }
+  if (!literal) { return l; }
+
+  /* Call the builtin now, with the function below its arguments */
+  if (l->count > lfold_args_capacity) {
+    while (l->count > lfold_args_capacity) {
+      lfold_args_capacity = lfold_args_capacity ? lfold_args_capacity * 2 : 16;
+    }
+    lfold_args = realloc(lfold_args, sizeof(lval*) * lfold_args_capacity);
+  }
+  lfold_args[0] = f;
+  memcpy(&lfold_args[1], &l->value.cell[1], sizeof(lval*) * (l->count - 1));
+
+  lval* r = f->value.fun.call(e, l->count - 1, &lfold_args[1]);
+  if (!lfold_is_literal(r)) { return l; }
+  lfold.calls++;
+  return r;
+}
+
+/* Fold code v against the bindings of e, return v if nothing changed
+ * Lists are folded from an explicit stack, innermost first and in the
+ * order they are evaluated in.
+ */
+lval* lval_fold(lenv* e, lval* v) {
+  int n = 0;
+  int stop = 0;
+  lval* r;
+
+  lfold.runs++;
+
+  for (;;) {
+    /* Fold v into r, or push it when it is a list
+     * Special forms are left as they are: their operands may never be
+     * evaluated, and may change bindings when they are.
+     */
+    int form = lform_kind(v);
+    if (form == LFORM_NONE && lval_type(v) == LVAL_LIST && v->count > 0) {
+      if (n == lfold_frames_capacity) {
+        lfold_frames_capacity = lfold_frames_capacity ?
+          lfold_frames_capacity * 2 : 64;
+        lfold_frames = realloc(lfold_frames,
+                               sizeof(lfold_frame) * lfold_frames_capacity);
+      }
+      lfold_frame* f = &lfold_frames[n++];
+      f->v = v;
+      f->copy = NULL;
+      f->next = 0;
+      f->literal = 1;
+      v = v->value.cell[0];
+      continue;
+    }
+
+    r = v;
+    if (form != LFORM_NONE) {
+      stop = 1;
+    } else if (!stop) {
+      lval* x = lfold_global(e, v);
+      if (x && lfold_is_literal(x)) {
+        r = x;
+        lfold.globals++;
+      }
+    }
+
+    /* Hand r to the list waiting for it, folding the lists completed */
+    for (;;) {
+      if (n == 0) { return r; }
+
+      lfold_frame* f = &lfold_frames[n - 1];
+      lval* l = f->copy ? f->copy : f->v;
+      int i = f->next;
+      if (r != l->value.cell[i]) {
+        if (f->copy == NULL) {
+          l = f->copy = lval_list_from(f->v->count, f->v->value.cell);
+        }
+        lgc_write_barrier(l, r);
+        l->value.cell[i] = r;
+      }
+      if (i > 0 && !lfold_is_literal(r)) { f->literal = 0; }
+
+      if (++f->next < l->count) {
+        v = l->value.cell[f->next];
+        break;
+      }
+      r = lfold_list(e, l, f->literal, &stop);
+      n--;
+    }
+  }
+}
+
+/* Fill s with the folding statistics */
+void lfold_get_stats(lfold_stats* s) {
+  *s = lfold;
+}
+
+/* Print the folding statistics */
+void lfold_print_stats(void) {
+  printf("fold: %li runs, %li calls and %li globals folded\n",
+         lfold.runs, lfold.calls, lfold.globals);
+}
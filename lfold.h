@@ -0,0 +1,40 @@
+#if !defined(__LFOLD_H__)
+#define __LFOLD_H__
+
+#include "lval.h"
+
+/* Constant folding
+ *
+ * The folder runs over code after it is resolved and before it is
+ * evaluated or compiled. In evaluated positions it replaces
+ *
+ *   - a global bound to a number or a q-expr, and never redefined since
+ *     it was bound, by that value
+ *   - a call of a pure builtin (flagged LVAL_F_PURE) on literal arguments,
+ *     numbers and q-exprs once folded, by its result unless that is an
+ *     error
+ *
+ * Special forms (see lform.h) are left as they are, and stop folding.
+ *
+ * The code itself is never changed: the lists that hold folded values
+ * are copied. Evaluation may change the bindings the folder looked up,
+ * so folding stops at the first call it cannot fold, and code kept after
+ * folding must be folded again once lenv_const_version changes.
+ */
+
+typedef struct lfold_stats {
+  long runs;            /* pieces of code folded */
+  long calls;           /* calls replaced by their result */
+  long globals;         /* globals replaced by their value */
+} lfold_stats;
+
+/* Fold code v against the bindings of e, return v if nothing changed */
+lval* lval_fold(lenv* e, lval* v);
+
+/* Fill s with the folding statistics */
+void lfold_get_stats(lfold_stats* s);
+
+/* Print the folding statistics */
+void lfold_print_stats(void);
+
+#endif
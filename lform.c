@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include "lform.h"
+#include "lresolve.h"
+
+static const char* lform_names[LFORM_COUNT] = {
+  NULL, "if", "when", "cond", "and", "or", "while", "dotimes", "for-each"
+};
+
+/* Interned head symbol of each form, indexed by kind */
+static lval* lform_syms[LFORM_COUNT];
+
+/* Special form list v is, or LFORM_NONE */
+int lform_kind(lval* v) {
+  if (lval_type(v) != LVAL_LIST || v->count < 2) { return LFORM_NONE; }
+
+  lval* k = v->value.cell[0];
+  if (lval_type(k) == LVAL_REF) { k = k->value.ref.sym; }
+  if (lval_type(k) != LVAL_SYM) { return LFORM_NONE; }
+
+  if (lform_syms[LFORM_IF] == NULL) {
+    for (int i = LFORM_IF; i < LFORM_COUNT; i++) {
+      lform_syms[i] = lval_sym((char*)lform_names[i]);
+    }
+  }
+  for (int i = LFORM_IF; i < LFORM_COUNT; i++) {
+    if (lform_syms[i] == k) { return i; }
+  }
+  return LFORM_NONE;
+}
+
+/* Error for special form v of the given kind if it is malformed, or NULL */
+lval* lform_check(lval* v, int kind) {
+  int n = v->count - 1;
+  switch (kind) {
+    case LFORM_IF:
+      if (n < 2 || n > 3) {
+        return lval_err(LERR_BAD_LIST,
+          "Form 'if' passed incorrect number of operands. "
+          "Got %i, Expected 2 or 3.", n);
+      }
+      break;
+
+    case LFORM_DOTIMES:
+    case LFORM_FOREACH: {
+      lval* b = v->value.cell[1];
+      lval* k = lval_type(b) == LVAL_LIST && b->count == 2 ?
+        b->value.cell[0] : NULL;
+      if (k == NULL ||
+          (lval_type(k) != LVAL_SYM && lval_type(k) != LVAL_REF)) {
+        return lval_err(LERR_BAD_LIST,
+          "Form '%s' passed incorrect binding. "
+          "Expected a list of a symbol and a value.", lform_names[kind]);
+      }
+      break;
+    }
+
+    case LFORM_COND:
+      for (int i = 1; i <= n; i++) {
+        lval* c = v->value.cell[i];
+        if (lval_type(c) != LVAL_LIST || c->count == 0) {
+          return lval_err(LERR_BAD_LIST,
+            "Form 'cond' passed incorrect clause %i. "
+            "Expected a list starting with a test.", i);
+        }
+      }
+      break;
+  }
+  return NULL;
+}
+
+/* Check whether code v has a loop outside of quoted code
+ * Nested lists are looked at from a worklist rather than by recursion.
+ */
+int lform_has_loop(lval* v) {
+  static lval** work = NULL;
+  static int capacity = 0;
+
+  if (lval_type(v) != LVAL_LIST) { return 0; }
+
+  int n = 0;
+  for (lval* l = v; ; l = work[--n]) {
+    int kind = lform_kind(l);
+    if (kind == LFORM_WHILE || kind == LFORM_DOTIMES ||
+        kind == LFORM_FOREACH) {
+      return 1;
+    }
+    if (n + l->count > capacity) {
+      while (n + l->count > capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+      }
+      work = realloc(work, sizeof(lval*) * capacity);
+    }
+    for (int i = 0; i < l->count; i++) {
+      lval* x = l->value.cell[i];
+      if (lval_type(x) == LVAL_LIST) { work[n++] = x; }
+    }
+    if (n == 0) { return 0; }
+  }
+}
+
+/* Symbol loop v binds, v well formed */
+lval* lform_var(lval* v) {
+  lval* k = v->value.cell[1]->value.cell[0];
+  return lval_type(k) == LVAL_REF ? k->value.ref.sym : k;
+}
+
+/* Start the loop of the given kind binding k, given the value x of its
+ * binding
+ * A count is kept in slot 1 and the variable in slot 0, counted from
+ * there. A list is kept in slot 1 and the position of the element in
+ * slot 0 in slot 2.
+ */
+lval* lform_enter(lenv* e, int kind, lval* k, lval* x) {
+  if (kind == LFORM_DOTIMES) {
+    if (lval_type(x) != LVAL_NUM) {
+      return lval_err(LERR_BAD_NUM,
+        "Form 'dotimes' passed incorrect type for its count. "
+        "Got %s, Expected %s.",
+        ltype_name(lval_type(x)), ltype_name(LVAL_NUM));
+    }
+    if (lval_num_value(x) <= 0) { return lval_list(); }
+
+    lframe* f = lframe_enter(e, 2);
+    f->slots[0] = lval_fixnum(0);
+    f->slots[1] = x;
+    lframe_bind(e, 0, k);
+    return NULL;
+  }
+
+  if (lval_type(x) != LVAL_QEXPR || lval_type(x->value.qexpr) != LVAL_LIST) {
+    return lval_err(LERR_BAD_LIST,
+      "Form 'for-each' passed incorrect type for its list. "
+      "Got %s, Expected %s.",
+      ltype_name(lval_type(x)), ltype_name(LVAL_QEXPR));
+  }
+  lval* l = x->value.qexpr;
+  if (l->count == 0) { return lval_list(); }
+
+  lframe* f = lframe_enter(e, 3);
+  f->slots[0] = l->value.cell[0];
+  f->slots[1] = l;
+  f->slots[2] = lval_fixnum(0);
+  lframe_bind(e, 0, k);
+  return NULL;
+}
+
+/* Step the loop of the innermost frame of e, return 0 once it is done */
+int lform_step(lenv* e, int kind) {
+  lval** s = e->frame->slots;
+
+  if (kind == LFORM_DOTIMES) {
+    long i = lval_num_value(s[0]) + 1;
+    if (i >= lval_num_value(s[1])) { return 0; }
+    s[0] = lval_num(i);
+    return 1;
+  }
+
+  long i = lval_num_value(s[2]) + 1;
+  if (i >= s[1]->count) { return 0; }
+  s[0] = s[1]->value.cell[i];
+  s[2] = lval_fixnum(i);
+  return 1;
+}
@@ -0,0 +1,74 @@
+#if !defined(__LFORM_H__)
+#define __LFORM_H__
+
+#include "lval.h"
+
+/* Special forms
+ *
+ * A list whose head is one of these symbols is not a call: its operands
+ * are only evaluated as needed, from left to right.
+ *
+ *   (if test then [else])        then or else, () without else
+ *   (when test body...)          the bodies in order, () unless test
+ *   (cond (test body...)...)     the bodies of the first clause whose test
+ *                                is true, or that test without bodies,
+ *                                () when there is none
+ *   (and x...)                   the first false x or the last
+ *   (or x...)                    the first true x or the last
+ *   (while test body...)         the bodies in order for as long as test
+ *                                is true, then ()
+ *   (dotimes (x n) body...)      the bodies with x bound to 0, 1, ... n-1
+ *                                in turn, then ()
+ *   (for-each (x l) body...)     the bodies with x bound to each element
+ *                                of the quoted list l in turn, then ()
+ *
+ * Forms take at least one operand: like any single element list, (and)
+ * evaluates to what the symbol and is bound to. Truth is lval_is_false.
+ * The operand whose value is the value of the form is in tail position
+ * when the form is, and an error from any operand ends the form with
+ * that error.
+ *
+ * The loops evaluate n or l once, before their first body. Their variable
+ * is bound in a local frame of its own (see lresolve.h) while the bodies
+ * run, and each step only changes its slot: the count is an immediate
+ * number, the elements are bound as they are, so a loop allocates nothing
+ * once it started. No operand of a loop is in tail position.
+ *
+ * The heads are keywords: they are recognized by symbol, resolved or
+ * not, whatever they are bound to.
+ */
+
+enum { LFORM_NONE, LFORM_IF, LFORM_WHEN, LFORM_COND, LFORM_AND, LFORM_OR,
+       LFORM_WHILE, LFORM_DOTIMES, LFORM_FOREACH, LFORM_COUNT };
+
+/* Special form list v is, or LFORM_NONE */
+int lform_kind(lval* v);
+
+/* Error for special form v of the given kind if it is malformed, or NULL */
+lval* lform_check(lval* v, int kind);
+
+/* Check whether code v has a loop outside of quoted code */
+int lform_has_loop(lval* v);
+
+/* Loops binding a variable, dotimes and for-each
+ * A loop is started with the value x of its binding, never an error. Each
+ * step after the bodies moves it to its next value, and once it is done
+ * its frame is left with lframe_leave. An error from the bodies leaves
+ * the frame as it ends the evaluation (see lvm_run).
+ */
+
+/* Symbol loop v binds, v well formed */
+lval* lform_var(lval* v);
+
+/* Start the loop of the given kind binding k, given the value x of its
+ * binding
+ * Return NULL once a frame binding k to the first value is the innermost
+ * frame of e, or the value of the form when there is nothing to run: ()
+ * or an error.
+ */
+lval* lform_enter(lenv* e, int kind, lval* k, lval* x);
+
+/* Step the loop of the innermost frame of e, return 0 once it is done */
+int lform_step(lenv* e, int kind);
+
+#endif
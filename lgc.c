@@ -0,0 +1,585 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lgc.h"
+#include "lalloc.h"
+#include "lvm.h"
+#include "lresolve.h"
+
+#define LGC_NURSERY  (256 * 1024)
+#define LGC_MIN_HEAP (1024 * 1024)
+#define LGC_GROWTH   2.0
+
+/* Root arrays that can be registered with lgc_add_range */
+#define LGC_RANGES 8
+
+/* Values marked or swept between two checks of the slice clock */
+#define LGC_CLOCK_STRIDE 64
+
+/* Phases of a major collection */
+enum { LGC_IDLE, LGC_MARK, LGC_SWEEP };
+
+static struct {
+  /* Young values */
+  larena nursery;
+
+  /* Every old value */
+  lval** objects;
+  long count;
+  long capacity;
+
+  /* Old values pointing to young ones */
+  lval** remembered;
+  long remembered_count;
+  long remembered_capacity;
+
+  /* Roots */
+  lval*** roots;
+  long roots_count;
+  long roots_capacity;
+  lenv** envs;
+  int envs_count;
+  struct { lval*** slots; int* count; } ranges[LGC_RANGES];
+  int ranges_count;
+
+  /* Values copied by a minor collection but not scanned yet */
+  lval** stack;
+  long stack_count;
+  long stack_capacity;
+
+  /* Grey values: marked by the major collection but not scanned yet */
+  lval** gray;
+  long gray_count;
+  long gray_capacity;
+
+  /* Major collection in progress */
+  int phase;
+  long sweep_next;        /* next entry of objects to sweep */
+  long sweep_kept;        /* entries kept so far */
+  long cycle_start;       /* time the collection started */
+
+  int epoch;
+  lgc_policy policy;
+  lgc_stats stats;
+} lgc;
+
+/* Grow array *p of *cap elements of size n to hold at least need */
+static void lgc_reserve(void* p, long* cap, long need, size_t n) {
+  if (need <= *cap) { return; }
+  long c = *cap ? *cap : 64;
+  while (c < need) { c *= 2; }
+  void** a = p;
+  *a = realloc(*a, c * n);
+  if (*a == NULL) {
+    perror("lispy: out of memory");
+    exit(1);
+  }
+  *cap = c;
+}
+
+/* Read the growth policy from the environment, open the nursery */
+static void lgc_init(void) {
+  lgc.policy.nursery = LGC_NURSERY;
+  lgc.policy.min_heap = LGC_MIN_HEAP;
+  lgc.policy.growth = LGC_GROWTH;
+
+  char* s = getenv("LISPY_GC_NURSERY");
+  if (s && atol(s) > 0) { lgc.policy.nursery = atol(s); }
+  s = getenv("LISPY_GC_MIN_HEAP");
+  if (s && atol(s) > 0) { lgc.policy.min_heap = atol(s); }
+  s = getenv("LISPY_GC_GROWTH");
+  if (s && atof(s) > 1.0) { lgc.policy.growth = atof(s); }
+
+  s = getenv("LISPY_GC_SLICE_US");
+  if (s && atol(s) > 0) { lgc.policy.slice_us = atol(s); }
+  s = getenv("LISPY_GC_SLICE_OBJECTS");
+  if (s && atol(s) > 0) { lgc.policy.slice_objects = atol(s); }
+
+  lgc.stats.threshold = lgc.policy.min_heap;
+  lgc.epoch = 1;
+  larena_begin(&lgc.nursery);
+}
+
+/* Add v to the table of old values */
+static void lgc_track(lval* v) {
+  lgc_reserve(&lgc.objects, &lgc.capacity, lgc.count + 1, sizeof(lval*));
+  lgc.objects[lgc.count++] = v;
+}
+
+/* Epoch of the marking in progress, 0 when the collector is not marking */
+int lgc_marking;
+
+/* Queue old value v for marking */
+static void lgc_push_gray(lval* v) {
+  lgc_reserve(&lgc.gray, &lgc.gray_capacity, lgc.gray_count + 1,
+    sizeof(lval*));
+  lgc.gray[lgc.gray_count++] = v;
+}
+
+/* Allocate a new value, in the nursery when there is one
+ * Old values created during a major collection are never swept by it.
+ * While marking they are grey, as their elements are not filled in yet.
+ */
+lval* lgc_alloc(void) {
+  if (lgc.epoch == 0) { lgc_init(); }
+
+  lval* v = lval_alloc();
+  if (v->flags & LVAL_F_ARENA) { return v; }
+
+  lgc_track(v);
+  if (lgc.phase != LGC_IDLE) { v->mark = lgc.epoch; }
+  if (lgc.phase == LGC_MARK) { lgc_push_gray(v); }
+  return v;
+}
+
+/* Remember old value o, it is made to point to young values */
+void lgc_remember(lval* o) {
+  o->flags |= LVAL_F_REMEMBERED;
+  lgc_reserve(&lgc.remembered, &lgc.remembered_capacity,
+    lgc.remembered_count + 1, sizeof(lval*));
+  lgc.remembered[lgc.remembered_count++] = o;
+}
+
+/* Mark old value x, it is stored in a value already scanned */
+void lgc_shade(lval* x) {
+  if (x->mark == lgc.epoch) { return; }
+  x->mark = lgc.epoch;
+  lgc_push_gray(x);
+}
+
+/* Push the address of a variable holding a value on the root stack */
+void lgc_push_root(lval** slot) {
+  lgc_reserve(&lgc.roots, &lgc.roots_capacity, lgc.roots_count + 1,
+    sizeof(lval**));
+  lgc.roots[lgc.roots_count++] = slot;
+}
+
+/* Current height of the root stack */
+int lgc_root_height(void) {
+  return lgc.roots_count;
+}
+
+/* Pop the root stack back to height h */
+void lgc_pop_roots(int h) {
+  lgc.roots_count = h;
+}
+
+/* Add an environment to the roots */
+void lgc_add_env(lenv* e) {
+  lgc.envs = realloc(lgc.envs, sizeof(lenv*) * (lgc.envs_count + 1));
+  lgc.envs[lgc.envs_count++] = e;
+}
+
+/* Remove an environment from the roots */
+void lgc_remove_env(lenv* e) {
+  for (int i = 0; i < lgc.envs_count; i++) {
+    if (lgc.envs[i] == e) {
+      lgc.envs[i] = lgc.envs[--lgc.envs_count];
+      return;
+    }
+  }
+}
+
+/* Add the array *slots of *count values to the roots */
+void lgc_add_range(lval*** slots, int* count) {
+  if (lgc.ranges_count == LGC_RANGES) {
+    fputs("lispy: too many root arrays\n", stderr);
+    exit(1);
+  }
+  lgc.ranges[lgc.ranges_count].slots = slots;
+  lgc.ranges[lgc.ranges_count].count = count;
+  lgc.ranges_count++;
+}
+
+/* Queue v for scanning */
+static void lgc_push(lval* v) {
+  lgc_reserve(&lgc.stack, &lgc.stack_capacity, lgc.stack_count + 1,
+    sizeof(lval*));
+  lgc.stack[lgc.stack_count++] = v;
+}
+
+static long lgc_now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* Count a pause of ns nanoseconds in histogram h */
+static void lgc_record_pause(long* h, long ns) {
+  int i = 0;
+  for (long us = ns / 1000; us > 0 && i < LGC_HISTOGRAM - 1; us >>= 1) {
+    i++;
+  }
+  h[i]++;
+}
+
+
+/* Minor collection */
+
+/* Copy young value v into the old generation, return where it lives now
+ * The copy still points to young values, it is queued to be scanned.
+ * The nursery copy is overwritten with a forwarding pointer.
+ */
+static lval* lgc_evacuate(lval* v) {
+  if (v == NULL || lval_is_fixnum(v) || !(v->flags & LVAL_F_ARENA)) {
+    return v;
+  }
+  if (v->flags & LVAL_F_FORWARDED) { return v->value.qexpr; }
+
+  larena* nursery = larena_swap(NULL);
+  lval* x = lgc_alloc();
+  x->type = v->type;
+  x->flags |= v->flags & LVAL_F_KEPT;
+  x->count = v->count;
+
+  switch (v->type) {
+    case LVAL_NUM: x->value.num = v->value.num; break;
+    case LVAL_FUN: x->value.fun = v->value.fun; break;
+    case LVAL_REF: x->value.ref = v->value.ref; break;
+    case LVAL_ERR:
+      x->value.err = v->value.err;
+      if (x->value.err.args) { lgc_push(x); }
+      break;
+    case LVAL_LIST:
+      x->value.cell = lcells_alloc(x, v->count);
+      if (v->count) {
+        memcpy(x->value.cell, v->value.cell, sizeof(lval*) * v->count);
+      }
+      lgc_push(x);
+      break;
+    case LVAL_QEXPR:
+      x->value.qexpr = v->value.qexpr;
+      lgc_push(x);
+      break;
+  }
+  larena_swap(nursery);
+
+  v->flags |= LVAL_F_FORWARDED;
+  v->value.qexpr = x;
+  lgc.stats.promoted++;
+  return x;
+}
+
+/* Evacuate everything old value o points to */
+static void lgc_scan_young(lval* o) {
+  switch (o->type) {
+    case LVAL_LIST:
+      for (int i = 0; i < o->count; i++) {
+        o->value.cell[i] = lgc_evacuate(o->value.cell[i]);
+      }
+      break;
+    case LVAL_QEXPR:
+      o->value.qexpr = lgc_evacuate(o->value.qexpr);
+      break;
+    case LVAL_ERR:
+      o->value.err.args = lgc_evacuate(o->value.err.args);
+      break;
+  }
+}
+
+/* Empty the nursery now */
+void lgc_minor(void) {
+  if (lgc.epoch == 0) { lgc_init(); }
+
+  long start = lgc_now_ns();
+
+  for (long i = 0; i < lgc.roots_count; i++) {
+    *lgc.roots[i] = lgc_evacuate(*lgc.roots[i]);
+  }
+  for (int i = 0; i < lgc.ranges_count; i++) {
+    lval** a = *lgc.ranges[i].slots;
+    for (int j = 0; j < *lgc.ranges[i].count; j++) {
+      a[j] = lgc_evacuate(a[j]);
+    }
+  }
+  for (int i = 0; i < lgc.envs_count; i++) {
+    for (lframe* f = lgc.envs[i]->frame; f; f = f->parent) {
+      for (int j = 0; j < f->count; j++) {
+        f->slots[j] = lgc_evacuate(f->slots[j]);
+      }
+    }
+  }
+  for (long i = 0; i < lgc.remembered_count; i++) {
+    lval* o = lgc.remembered[i];
+    o->flags &= ~LVAL_F_REMEMBERED;
+    lgc_scan_young(o);
+  }
+  lgc.remembered_count = 0;
+
+  while (lgc.stack_count) {
+    lgc_scan_young(lgc.stack[--lgc.stack_count]);
+  }
+
+  lgc.stats.nursery_bytes += lgc.nursery.bytes;
+  larena_end(&lgc.nursery);
+  larena_begin(&lgc.nursery);
+
+  long pause = lgc_now_ns() - start;
+  lgc.stats.minor_collections++;
+  lgc.stats.minor_pause_ns += pause;
+  if (pause > lgc.stats.minor_max_pause_ns) {
+    lgc.stats.minor_max_pause_ns = pause;
+  }
+  lgc_record_pause(lgc.stats.minor_pause_histogram, pause);
+}
+
+
+/* Major collection
+ *
+ * Tri-color marking: white values have an old mark, grey ones are on the
+ * gray stack and black ones are marked and scanned. Marking and sweeping
+ * can be split in slices run from successive safepoints. Between slices
+ * the evaluator keeps running, so:
+ *  - values created meanwhile are allocated grey (or black when sweeping)
+ *  - stores of white values into old ones shade them (lgc_write_barrier)
+ *  - roots are scanned again before marking ends, as the root stack and
+ *    the environments change without any barrier.
+ * Young values are never marked, they are copied into the old generation
+ * as grey values by the minor collections.
+ */
+
+/* Mark v and queue it for scanning */
+static void lgc_mark(lval* v) {
+  if (v == NULL || lval_is_fixnum(v) || (v->flags & LVAL_F_ARENA)) {
+    return;
+  }
+  if (v->mark == lgc.epoch) { return; }
+  v->mark = lgc.epoch;
+  lgc_push_gray(v);
+}
+
+/* Mark what the environments, their frames, the root stack and arrays
+ * point to
+ */
+static void lgc_mark_roots(void) {
+  for (int i = 0; i < lgc.envs_count; i++) {
+    lenv* e = lgc.envs[i];
+    for (int j = 0; j < e->count; j++) { lgc_mark(e->vars[j].val); }
+    for (lframe* f = e->frame; f; f = f->parent) {
+      for (int j = 0; j < f->count; j++) { lgc_mark(f->slots[j]); }
+    }
+  }
+  for (long i = 0; i < lgc.roots_count; i++) {
+    lgc_mark(*lgc.roots[i]);
+  }
+  for (int i = 0; i < lgc.ranges_count; i++) {
+    lval** a = *lgc.ranges[i].slots;
+    for (int j = 0; j < *lgc.ranges[i].count; j++) { lgc_mark(a[j]); }
+  }
+}
+
+/* Scan grey values until none is left or the slice is over */
+static int lgc_drain(long* budget, long deadline) {
+  for (long n = 0; lgc.gray_count; n++) {
+    if (*budget == 0) { return 0; }
+    if (deadline && n % LGC_CLOCK_STRIDE == 0 && lgc_now_ns() >= deadline) {
+      return 0;
+    }
+    lval* v = lgc.gray[--lgc.gray_count];
+    switch (v->type) {
+      case LVAL_LIST:
+        for (int i = 0; i < v->count; i++) { lgc_mark(v->value.cell[i]); }
+        break;
+      case LVAL_QEXPR:
+        lgc_mark(v->value.qexpr);
+        break;
+      case LVAL_ERR:
+        lgc_mark(v->value.err.args);
+        break;
+    }
+    if (*budget > 0) { (*budget)--; }
+  }
+  return 1;
+}
+
+/* Release a value the collector found unreachable */
+static void lgc_free(lval* v) {
+  switch (v->type) {
+    case LVAL_LIST:
+      if (v->flags & LVAL_F_COMPILED) { lvm_forget(v); }
+      lcells_free(v, v->value.cell, v->count);
+      break;
+  }
+  lval_free(v);
+}
+
+/* Sweep unmarked values until the table is done or the slice is over */
+static int lgc_sweep(long* budget, long deadline) {
+  size_t before = lheap_bytes();
+  long freed = 0;
+  int done = 1;
+
+  /* Values tracked meanwhile are appended, and kept, until count */
+  for (long n = 0; lgc.sweep_next < lgc.count; n++) {
+    if (*budget == 0 ||
+        (deadline && n % LGC_CLOCK_STRIDE == 0 && lgc_now_ns() >= deadline)) {
+      done = 0;
+      break;
+    }
+    lval* v = lgc.objects[lgc.sweep_next++];
+    if (v->mark == lgc.epoch) {
+      lgc.objects[lgc.sweep_kept++] = v;
+    } else {
+      lgc_free(v);
+      freed++;
+    }
+    if (*budget > 0) { (*budget)--; }
+  }
+
+  lgc.stats.objects_reclaimed += freed;
+  lgc.stats.bytes_reclaimed += before - lheap_bytes();
+  if (done) { lgc.count = lgc.sweep_kept; }
+  return done;
+}
+
+/* Start a major collection, the nursery is emptied first */
+static void lgc_start(void) {
+  lgc_minor();
+
+  /* A new epoch makes every value white at once */
+  lgc.epoch = lgc.epoch == 0x7fffffff ? 1 : lgc.epoch + 1;
+  lgc.phase = LGC_MARK;
+  lgc_marking = lgc.epoch;
+  lgc.cycle_start = lgc_now_ns();
+  lgc_mark_roots();
+}
+
+/* Finish the major collection in progress */
+static void lgc_finish(void) {
+  size_t live = lheap_bytes();
+  size_t next = (size_t)(live * lgc.policy.growth);
+  lgc.stats.threshold = next > lgc.policy.min_heap ? next : lgc.policy.min_heap;
+  lgc.stats.collections++;
+  lgc.stats.cycle_ns += lgc_now_ns() - lgc.cycle_start;
+  lgc.phase = LGC_IDLE;
+}
+
+/* Do at most budget values (-1 for no limit) of the major collection
+ * in progress, stopping at deadline (0 for none)
+ */
+static void lgc_step(long budget, long deadline) {
+  if (lgc.phase == LGC_MARK) {
+    if (!lgc_drain(&budget, deadline)) { return; }
+
+    /* Roots may hold white values the marking has not seen */
+    lgc_minor();
+    lgc_mark_roots();
+    long all = -1;
+    lgc_drain(&all, 0);
+
+    lgc_marking = 0;
+    lgc.phase = LGC_SWEEP;
+    lgc.sweep_next = 0;
+    lgc.sweep_kept = 0;
+  }
+  if (lgc.phase == LGC_SWEEP && lgc_sweep(&budget, deadline)) {
+    lgc_finish();
+  }
+}
+
+/* Run one slice of the major collection, starting one if needed
+ * The slice does at most budget values (-1 for no limit) and lasts about
+ * us microseconds (0 for no limit).
+ */
+static void lgc_slice(long budget, long us) {
+  long start = lgc_now_ns();
+
+  if (lgc.phase == LGC_IDLE) { lgc_start(); }
+  lgc_step(budget, us > 0 ? start + us * 1000 : 0);
+
+  long pause = lgc_now_ns() - start;
+  lgc.stats.slices++;
+  lgc.stats.pause_ns += pause;
+  if (pause > lgc.stats.max_pause_ns) { lgc.stats.max_pause_ns = pause; }
+  lgc_record_pause(lgc.stats.pause_histogram, pause);
+}
+
+/* Collect everything now, finishing any collection in progress */
+void lgc_collect(void) {
+  if (lgc.epoch == 0) { lgc_init(); }
+  lgc_slice(-1, 0);
+}
+
+/* Collect if the nursery is full or the heap has grown past threshold */
+void lgc_safepoint(void) {
+  if (lgc.epoch == 0) { return; }
+
+  if (lgc.nursery.bytes >= lgc.policy.nursery) { lgc_minor(); }
+  if (lgc.phase != LGC_IDLE || lheap_bytes() >= lgc.stats.threshold) {
+    long n = lgc.policy.slice_objects;
+    lgc_slice(n > 0 ? n : -1, lgc.policy.slice_us);
+  }
+}
+
+/* Get the heap growth policy */
+void lgc_get_policy(lgc_policy* p) {
+  if (lgc.epoch == 0) { lgc_init(); }
+  *p = lgc.policy;
+}
+
+/* Change the heap growth policy */
+void lgc_set_policy(const lgc_policy* p) {
+  if (lgc.epoch == 0) { lgc_init(); }
+  lgc.policy = *p;
+  lgc.stats.threshold = p->min_heap;
+}
+
+/* Fill s with the collector statistics */
+void lgc_get_stats(lgc_stats* s) {
+  *s = lgc.stats;
+  s->nursery_bytes += lgc.nursery.bytes;
+  s->objects = lgc.count;
+  s->heap_bytes = lheap_bytes();
+}
+
+/* Upper bound in microseconds of the pauses of histogram h below
+ * fraction q of all of them
+ */
+long lgc_pause_quantile(const long* h, double q) {
+  long total = 0;
+  for (int i = 0; i < LGC_HISTOGRAM; i++) { total += h[i]; }
+  if (total == 0) { return 0; }
+
+  long seen = 0;
+  for (int i = 0; i < LGC_HISTOGRAM; i++) {
+    seen += h[i];
+    if (seen >= q * total) { return 1L << i; }
+  }
+  return 1L << (LGC_HISTOGRAM - 1);
+}
+
+/* Print the non empty buckets of pause histogram h */
+static void lgc_print_histogram(const char* name, const long* h) {
+  if (lgc_pause_quantile(h, 1.0) == 0) {
+    printf("%s pauses: none\n", name);
+    return;
+  }
+  printf("%s pauses: p50 < %li us, p99 < %li us\n", name,
+    lgc_pause_quantile(h, 0.50), lgc_pause_quantile(h, 0.99));
+  for (int i = 0; i < LGC_HISTOGRAM; i++) {
+    if (h[i] == 0) { continue; }
+    printf("  < %8li us %10li\n", 1L << i, h[i]);
+  }
+}
+
+/* Print the collector statistics */
+void lgc_print_stats(void) {
+  lgc_stats s;
+  lgc_get_stats(&s);
+
+  printf("minor collections: %li, pause: total %.3f ms, max %.3f ms\n",
+    s.minor_collections, s.minor_pause_ns / 1e6, s.minor_max_pause_ns / 1e6);
+  printf("nursery: %zu bytes allocated, %li values promoted\n",
+    s.nursery_bytes, s.promoted);
+  printf("major collections: %li in %li slices, "
+    "pause: total %.3f ms, max %.3f ms\n",
+    s.collections, s.slices, s.pause_ns / 1e6, s.max_pause_ns / 1e6);
+  printf("reclaimed: %li values, %zu bytes\n",
+    s.objects_reclaimed, s.bytes_reclaimed);
+  printf("heap: %li values, %zu bytes, next collection at %zu bytes\n",
+    s.objects, s.heap_bytes, s.threshold);
+  lgc_print_histogram("minor", s.minor_pause_histogram);
+  lgc_print_histogram("major", s.pause_histogram);
+}
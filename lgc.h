@@ -0,0 +1,144 @@
+#if !defined(__LGC_H__)
+#define __LGC_H__
+
+#include <stddef.h>
+#include "lval.h"
+
+/* Generational garbage collector
+ *
+ * Values are no longer owned: builtins share their arguments freely and
+ * never delete anything.
+ *
+ * New values are bump-allocated in the nursery, an arena that is never
+ * freed value by value. A minor collection copies the nursery values
+ * that are still reachable into the old generation and then resets the
+ * whole nursery, so its cost depends on the survivors only. Old values
+ * are tracked in a table and reclaimed by mark and sweep in a major
+ * collection.
+ *
+ * The roots are every live lenv with its local frames (see lresolve.h),
+ * the root stack and the arrays added with lgc_add_range(). Code that
+ * keeps a value in a C variable across a call that may evaluate (and so
+ * reach a safepoint) must push the address of that variable on the root
+ * stack first, and read the variable again afterwards: a minor collection
+ * moves young values and updates the root slots. Collection only
+ * happens at lgc_safepoint(), never inside an allocation.
+ *
+ * Old values that are changed to point to young ones must go through
+ * lgc_write_barrier(), so the minor collection finds those pointers
+ * without scanning the old generation. The environment never points to
+ * young values, lenv_put() promotes them. Interned symbols (see lsym.h)
+ * live outside of both generations and are never collected.
+ *
+ * A major collection can be incremental: it then marks and sweeps in
+ * slices of bounded work, one per safepoint, while the evaluator keeps
+ * running in between. The same write barrier keeps the marking correct.
+ */
+
+/* Heap growth policy
+ * A minor collection is due once the nursery holds more than nursery
+ * bytes. A major collection is due once the old generation grows past
+ * max(min_heap, live bytes after the last major collection * growth).
+ * A major collection is incremental when slice_us or slice_objects is
+ * set: each slice stops after about slice_us microseconds or after
+ * slice_objects values marked or swept, whichever comes first.
+ * Defaults can be overridden with the LISPY_GC_NURSERY (bytes),
+ * LISPY_GC_MIN_HEAP (bytes), LISPY_GC_GROWTH, LISPY_GC_SLICE_US and
+ * LISPY_GC_SLICE_OBJECTS environment variables.
+ */
+typedef struct lgc_policy {
+  size_t nursery;
+  size_t min_heap;
+  double growth;
+  long slice_us;
+  long slice_objects;
+} lgc_policy;
+
+/* Pause histograms have one bucket per power of two microseconds */
+#define LGC_HISTOGRAM 24
+
+typedef struct lgc_stats {
+  long collections;       /* major collections */
+  long slices;            /* pauses they were split in */
+  long pause_ns;          /* total time spent in major collections */
+  long max_pause_ns;      /* longest slice */
+  long cycle_ns;          /* total time from start to end of collections */
+  long objects_reclaimed;
+  size_t bytes_reclaimed;
+  long minor_collections;
+  long minor_pause_ns;    /* total time spent in minor collections */
+  long minor_max_pause_ns;
+  long promoted;          /* values copied out of the nursery */
+  size_t nursery_bytes;   /* bytes allocated in the nursery so far */
+  long objects;           /* values in the old generation */
+  size_t heap_bytes;      /* bytes held by the old generation */
+  size_t threshold;       /* heap size that triggers the next collection */
+  long pause_histogram[LGC_HISTOGRAM];        /* major slices */
+  long minor_pause_histogram[LGC_HISTOGRAM];
+} lgc_stats;
+
+/* Allocate a new value, in the nursery when there is one */
+lval* lgc_alloc(void);
+
+/* Remember old value o, it is made to point to young values */
+void lgc_remember(lval* o);
+
+/* Mark old value x, it is stored in a value already scanned */
+void lgc_shade(lval* x);
+
+/* Epoch of the incremental marking in progress, 0 if there is none */
+extern int lgc_marking;
+
+/* Call before storing x inside of the existing value o */
+static inline void lgc_write_barrier(lval* o, lval* x) {
+  if (lval_is_fixnum(x)) { return; }
+  if (x->flags & LVAL_F_ARENA) {
+    if (!(o->flags & (LVAL_F_ARENA | LVAL_F_REMEMBERED))) { lgc_remember(o); }
+  } else if (lgc_marking && x->mark != lgc_marking) {
+    lgc_shade(x);
+  }
+}
+
+/* Push the address of a variable holding a value on the root stack */
+void lgc_push_root(lval** slot);
+
+/* Current height of the root stack */
+int lgc_root_height(void);
+
+/* Pop the root stack back to height h */
+void lgc_pop_roots(int h);
+
+/* Add the array *slots of *count values to the roots
+ * Both are read at each collection, so the array may be reallocated.
+ */
+void lgc_add_range(lval*** slots, int* count);
+
+/* Add or remove an environment from the roots */
+void lgc_add_env(lenv* e);
+void lgc_remove_env(lenv* e);
+
+/* Collect if the nursery is full or the heap has grown past threshold */
+void lgc_safepoint(void);
+
+/* Empty the nursery now */
+void lgc_minor(void);
+
+/* Collect everything now */
+void lgc_collect(void);
+
+/* Get or change the heap growth policy */
+void lgc_get_policy(lgc_policy* p);
+void lgc_set_policy(const lgc_policy* p);
+
+/* Fill s with the collector statistics */
+void lgc_get_stats(lgc_stats* s);
+
+/* Upper bound in microseconds of the pauses of histogram h below
+ * fraction q of all of them, 0 when the histogram is empty
+ */
+long lgc_pause_quantile(const long* h, double q);
+
+/* Print the collector statistics */
+void lgc_print_stats(void);
+
+#endif
@@ -0,0 +1,859 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "ljit.h"
+#include "lresolve.h"
+#include "lform.h"
+
+#if defined(LJIT_X86_64)
+#include <sys/mman.h>
+#include <unistd.h>
+
+int ljit_enabled = 1;
+#else
+int ljit_enabled = 0;
+#endif
+
+static ljit_stats ljit;
+
+/* Fill s with the native code statistics */
+void ljit_get_stats(ljit_stats* s) {
+  *s = ljit;
+}
+
+/* Print the native code statistics */
+void ljit_print_stats(void) {
+  printf("jit: %li codes translated, %li bytes kept, %li refused\n",
+         ljit.compiled, ljit.bytes, ljit.refused);
+  printf("jit: %li arithmetic calls bailed out\n", ljit.bailouts);
+}
+
+#if defined(LJIT_X86_64)
+
+/* Builtins done inline, see evaluation.c */
+extern lval* builtin_add(lenv* e, int argc, lval** argv);
+extern lval* builtin_sub(lenv* e, int argc, lval** argv);
+extern lval* builtin_mul(lenv* e, int argc, lval** argv);
+
+/* Executable memory
+ * Native code is packed into chunks mapped LJIT_CHUNK bytes at a time,
+ * writable only while code is being copied in. A chunk is unmapped once
+ * all of its code has been freed.
+ */
+#define LJIT_CHUNK (1 << 20)
+
+typedef struct ljit_chunk {
+  unsigned char* base;
+  size_t size;
+  size_t used;
+  size_t live;          /* bytes of code not freed yet */
+} ljit_chunk;
+
+static ljit_chunk* ljit_chunks = NULL;
+static int ljit_chunks_count = 0;
+static int ljit_chunks_capacity = 0;
+
+/* Copy the n bytes of code into executable memory, NULL if it cannot be */
+static void* ljit_place(const unsigned char* code, size_t n) {
+  ljit_chunk* k = ljit_chunks_count ? &ljit_chunks[ljit_chunks_count - 1] : NULL;
+
+  if (k == NULL || k->used + n > k->size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = n > LJIT_CHUNK ? (n + page - 1) / page * page : LJIT_CHUNK;
+    void* p = mmap(NULL, size, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { return NULL; }
+
+    if (ljit_chunks_count == ljit_chunks_capacity) {
+      ljit_chunks_capacity = ljit_chunks_capacity ? ljit_chunks_capacity * 2 : 8;
+      ljit_chunks = realloc(ljit_chunks,
+                            sizeof(ljit_chunk) * ljit_chunks_capacity);
+    }
+    k = &ljit_chunks[ljit_chunks_count++];
+    k->base = p;
+    k->size = size;
+    k->used = 0;
+    k->live = 0;
+  }
+
+  /* Only the pages written to are made writable, for the copy */
+  unsigned char* p = k->base + k->used;
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  unsigned char* from = (unsigned char*)((uintptr_t)p & ~(page - 1));
+  size_t len = p + n - from;
+  if (mprotect(from, len, PROT_READ | PROT_WRITE) != 0) { return NULL; }
+  memcpy(p, code, n);
+  if (mprotect(from, len, PROT_READ | PROT_EXEC) != 0) { return NULL; }
+
+  /* Keep code 16 byte aligned */
+  k->used = (k->used + n + 15) & ~(size_t)15;
+  if (k->used > k->size) { k->used = k->size; }
+  k->live += n;
+  return p;
+}
+
+/* Give back the n bytes of code at p */
+static void ljit_unplace(unsigned char* p, size_t n) {
+  for (int i = 0; i < ljit_chunks_count; i++) {
+    ljit_chunk* k = &ljit_chunks[i];
+    if (p < k->base || p >= k->base + k->size) { continue; }
+
+    k->live -= n;
+    if (k->live > 0) { return; }
+
+    /* The last chunk is the one code is added to, it is only emptied */
+    if (i == ljit_chunks_count - 1) {
+      k->used = 0;
+      return;
+    }
+    munmap(k->base, k->size);
+    memmove(k, k + 1, sizeof(ljit_chunk) * (ljit_chunks_count - i - 1));
+    ljit_chunks_count--;
+    return;
+  }
+}
+
+/* Machine code being generated */
+typedef struct ljit_buf {
+  unsigned char* bytes;
+  int count;
+  int capacity;
+} ljit_buf;
+
+static void ljit_byte(ljit_buf* b, int x) {
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : 256;
+    b->bytes = realloc(b->bytes, b->capacity);
+  }
+  b->bytes[b->count++] = (unsigned char)x;
+}
+
+static void ljit_imm32(ljit_buf* b, int32_t x) {
+  for (int i = 0; i < 4; i++) { ljit_byte(b, (uint32_t)x >> (8 * i)); }
+}
+
+/* Registers, by their encoding */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Registers kept by the templates */
+#define LJIT_ENV     RBX        /* environment */
+#define LJIT_CONSTS  R12        /* constants, lval** */
+#define LJIT_STACK   R13        /* VM stack of the run, lval** */
+#define LJIT_CODE    R14        /* the lcode run */
+#define LJIT_VERSION R15        /* &lenv_version */
+
+/* Emit the REX prefix, if any, and opcode, one byte or 0x0f and one */
+static void ljit_opcode(ljit_buf* b, int w, int opcode, int reg, int rm) {
+  int rex = (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+  if (rex) { ljit_byte(b, 0x40 | rex); }
+  if (opcode > 0xff) { ljit_byte(b, opcode >> 8); }
+  ljit_byte(b, opcode & 0xff);
+}
+
+/* Instruction on register (or opcode extension) reg and memory at
+ * [base+disp], 64 bit wide if w
+ */
+static void ljit_mem(ljit_buf* b, int w, int opcode, int reg, int base,
+                     int32_t disp) {
+  ljit_opcode(b, w, opcode, reg, base);
+  int mod = disp == 0 && (base & 7) != RBP ? 0 :
+            disp >= -128 && disp <= 127 ? 1 : 2;
+  ljit_byte(b, mod << 6 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) { ljit_byte(b, 0x24); }
+  if (mod == 1) { ljit_byte(b, disp); }
+  if (mod == 2) { ljit_imm32(b, disp); }
+}
+
+/* Instruction on registers (or opcode extension) reg and rm */
+static void ljit_reg(ljit_buf* b, int w, int opcode, int reg, int rm) {
+  ljit_opcode(b, w, opcode, reg, rm);
+  ljit_byte(b, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* mov r, [base+disp] */
+static void ljit_load(ljit_buf* b, int r, int base, int32_t disp) {
+  ljit_mem(b, 1, 0x8b, r, base, disp);
+}
+
+/* mov [base+disp], r */
+static void ljit_store(ljit_buf* b, int base, int32_t disp, int r) {
+  ljit_mem(b, 1, 0x89, r, base, disp);
+}
+
+/* mov r, imm64 */
+static void ljit_movabs(ljit_buf* b, int r, const void* p) {
+  ljit_opcode(b, 1, 0xb8 + (r & 7), 0, r);
+  uint64_t x = (uint64_t)(uintptr_t)p;
+  for (int i = 0; i < 8; i++) { ljit_byte(b, (int)(x >> (8 * i))); }
+}
+
+/* call f */
+static void ljit_call(ljit_buf* b, const void* f) {
+  ljit_movabs(b, RAX, f);
+  ljit_reg(b, 0, 0xff, 2, RAX);
+}
+
+/* Jumps are emitted with a 32 bit displacement, patched once the target
+ * is known
+ */
+enum { LJIT_JMP = -1, LJIT_JE = 0x84, LJIT_JNE = 0x85, LJIT_JO = 0x80,
+       LJIT_JGE = 0x8d, LJIT_JG = 0x8f };
+
+/* Jump with condition cc to a target not emitted yet, return the
+ * position of its displacement
+ */
+static int ljit_jump(ljit_buf* b, int cc) {
+  if (cc == LJIT_JMP) { ljit_byte(b, 0xe9); }
+  else { ljit_byte(b, 0x0f); ljit_byte(b, cc); }
+  ljit_imm32(b, 0);
+  return b->count - 4;
+}
+
+/* Set the displacement at `at` to reach position target */
+static void ljit_patch(ljit_buf* b, int at, int target) {
+  int32_t d = target - (at + 4);
+  memcpy(&b->bytes[at], &d, 4);
+}
+
+/* Code being translated
+ * Paths rarely taken, cache misses and bailouts, go to a cold part laid
+ * out after the code, so that the code itself stays dense. Jumps between
+ * the two parts, and the jumps of the bytecode, are patched once both
+ * are complete. The cold part starts with the exit taken on an error.
+ */
+enum { LJIT_TO_COLD, LJIT_TO_CODE, LJIT_TO_OP };
+
+typedef struct ljit_fixup {
+  int kind;             /* the jump goes from the code to the cold part,
+                           from the cold part to the code, or from the
+                           code to a bytecode instruction */
+  int at;               /* position of its displacement */
+  int target;           /* position or bytecode offset it reaches */
+} ljit_fixup;
+
+typedef struct ljit_asm {
+  ljit_buf code;
+  ljit_buf cold;
+  ljit_fixup* fixups;
+  int fixups_count;
+  int fixups_capacity;
+  ljit_native* native;  /* the translation, counting its bailouts */
+  int* offsets;         /* position in the code of each instruction */
+  int* depths;          /* values on the stack at jump targets, or -1 */
+} ljit_asm;
+
+static void ljit_fixup_add(ljit_asm* a, int kind, int at, int target) {
+  if (a->fixups_count == a->fixups_capacity) {
+    a->fixups_capacity = a->fixups_capacity ? a->fixups_capacity * 2 : 64;
+    a->fixups = realloc(a->fixups, sizeof(ljit_fixup) * a->fixups_capacity);
+  }
+  a->fixups[a->fixups_count++] = (ljit_fixup){ kind, at, target };
+}
+
+/* Make the jump of the code at `at` reach the end of the cold part */
+static void ljit_to_cold(ljit_asm* a, int at) {
+  ljit_fixup_add(a, LJIT_TO_COLD, at, a->cold.count);
+}
+
+/* Jump from the end of the cold part to position target of the code */
+static void ljit_to_code(ljit_asm* a, int target) {
+  ljit_fixup_add(a, LJIT_TO_CODE, ljit_jump(&a->cold, LJIT_JMP), target);
+}
+
+/* Jump with condition cc to the bytecode instruction at offset o, where k
+ * values are on the stack
+ */
+static void ljit_to_op(ljit_asm* a, int cc, lword o, int k) {
+  ljit_fixup_add(a, LJIT_TO_OP, ljit_jump(&a->code, cc), (int)o);
+  a->depths[o] = k;
+}
+
+/* Leave the run with the error in rax if the value in rax is one, from
+ * the code or the cold part b
+ */
+static void ljit_check(ljit_asm* a, ljit_buf* b) {
+  ljit_byte(b, 0xa8);                           /* test al, 1 */
+  ljit_byte(b, 1);
+  int ok = ljit_jump(b, LJIT_JNE);
+  ljit_mem(b, 0, 0x83, 7, RAX, offsetof(lval, type));   /* cmp dword */
+  ljit_byte(b, LVAL_ERR);
+  int fail = ljit_jump(b, LJIT_JE);
+  if (b == &a->cold) { ljit_patch(b, fail, 0); }
+  else { ljit_fixup_add(a, LJIT_TO_COLD, fail, 0); }
+  ljit_patch(b, ok, b->count);
+}
+
+/* Append the cold part to the code, patching the jumps between them */
+static void ljit_join(ljit_asm* a) {
+  int at = a->code.count;
+  for (int i = 0; i < a->fixups_count; i++) {
+    ljit_fixup* f = &a->fixups[i];
+    switch (f->kind) {
+      case LJIT_TO_COLD: ljit_patch(&a->code, f->at, at + f->target); break;
+      case LJIT_TO_CODE: ljit_patch(&a->cold, f->at, f->target - at); break;
+      case LJIT_TO_OP:
+        ljit_patch(&a->code, f->at, a->offsets[f->target]);
+        break;
+    }
+  }
+  for (int i = 0; i < a->cold.count; i++) { ljit_byte(&a->code, a->cold.bytes[i]); }
+}
+
+/* Templates
+ * The stack depth is known at each instruction, so value k of the run is
+ * found at [LJIT_STACK + 8*k] without keeping a stack pointer. The VM
+ * only needs the stack height when it is called.
+ */
+#define LJIT_SLOT(k) ((int32_t)(8 * (k)))
+
+/* The VM native code was translated for */
+static const ljit_vm* ljit_host;
+
+/* Load LJIT_CONSTS, the constants move with the collector */
+static void ljit_load_consts(ljit_buf* b) {
+  ljit_load(b, RAX, LJIT_CODE, offsetof(lcode, consts));
+  ljit_load(b, LJIT_CONSTS, RAX, offsetof(lval, value.cell));
+}
+
+/* Set value k to constant i, x */
+static void ljit_const(ljit_buf* b, int k, lword i, lval* x) {
+  intptr_t w = (intptr_t)x;
+  if (lval_is_fixnum(x) && w >= INT32_MIN && w <= INT32_MAX) {
+    /* mov qword [stack+8k], imm32 */
+    ljit_mem(b, 1, 0xc7, 0, LJIT_STACK, LJIT_SLOT(k));
+    ljit_imm32(b, (int32_t)w);
+    return;
+  }
+  ljit_load(b, RAX, LJIT_CONSTS, LJIT_SLOT(i));
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k), RAX);
+}
+
+/* Set value k to f(e, constant i), f being lenv_get or lenv_get_ref
+ * Neither reaches a safepoint, so the VM is not told about the stack.
+ */
+static void ljit_lookup(ljit_asm* a, int k, lword i, const void* f) {
+  ljit_buf* b = &a->code;
+  ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+  ljit_load(b, RSI, LJIT_CONSTS, LJIT_SLOT(i));
+  ljit_call(b, f);
+  ljit_check(a, b);
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k), RAX);
+}
+
+/* Set value k to slot s of the frame d levels up */
+static void ljit_local(ljit_buf* b, int k, lword d, lword s) {
+  ljit_load(b, RAX, LJIT_ENV, offsetof(lenv, frame));
+  for (; d > 0; d--) { ljit_load(b, RAX, RAX, offsetof(lframe, parent)); }
+  ljit_load(b, RAX, RAX, offsetof(lframe, slots));
+  ljit_load(b, RAX, RAX, LJIT_SLOT(s));
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k), RAX);
+}
+
+/* Set value k to the function cached by the CALLEE operands at ip,
+ * filling the cache first when it misses
+ */
+static void ljit_callee(ljit_asm* a, int k, lword* ip) {
+  ljit_buf* b = &a->code;
+  ljit_movabs(b, RDX, ip);
+  ljit_mem(b, 1, 0x63, RAX, LJIT_VERSION, 0);   /* movsxd rax, version */
+  ljit_mem(b, 1, 0x3b, RAX, RDX, 8);            /* cmp rax, [rdx+8] */
+  int miss = ljit_jump(b, LJIT_JNE);
+  ljit_mem(b, 1, 0x3b, LJIT_ENV, RDX, 16);      /* cmp rbx, [rdx+16] */
+  int miss_env = ljit_jump(b, LJIT_JNE);
+  int hit = b->count;
+  ljit_load(b, RAX, RDX, 24);
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k), RAX);
+
+  /* lvm_callee(e, consts, ip), rdx still holds ip */
+  ljit_to_cold(a, miss);
+  ljit_to_cold(a, miss_env);
+  b = &a->cold;
+  ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+  ljit_reg(b, 1, 0x89, LJIT_CONSTS, RSI);
+  ljit_call(b, (void*)ljit_host->callee);
+  ljit_movabs(b, RDX, ip);
+  ljit_load(b, RAX, RDX, 24);
+  ljit_check(a, b);
+  ljit_to_code(a, hit);
+}
+
+/* Make the call of the VM below the n values under top, with level calls
+ * pending in the run, return the top of the stack after it
+ * The VM and the collector are told the stack height, and the stack may
+ * have moved once the call returns.
+ */
+static lval** ljit_vm_call_at(lenv* e, lval** top, int n, int level,
+                              int tail) {
+  *ljit_host->sp = (int)(top - *ljit_host->stack);
+  ljit_host->call(e, n, level, tail);
+  return *ljit_host->stack + *ljit_host->sp;
+}
+
+/* Call, through the VM, the function below the top n of the k values,
+ * with level calls pending, from the code or the cold part b
+ * A pending tail evaluation leaves the run like an error, see lvm_exec.
+ */
+static void ljit_vm_call(ljit_asm* a, ljit_buf* b, int k, int n, int level,
+                         int tail) {
+  ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+  ljit_mem(b, 1, 0x8d, RSI, LJIT_STACK, LJIT_SLOT(k));  /* lea rsi */
+  ljit_byte(b, 0xba);                                   /* mov edx, n */
+  ljit_imm32(b, n);
+  ljit_byte(b, 0xb9);                                   /* mov ecx, level */
+  ljit_imm32(b, level);
+  ljit_opcode(b, 0, 0xb8 + (R8 & 7), 0, R8);            /* mov r8d, tail */
+  ljit_imm32(b, tail);
+  ljit_call(b, (void*)ljit_vm_call_at);
+  ljit_mem(b, 1, 0x8d, LJIT_STACK, RAX, -LJIT_SLOT(k - n));
+  ljit_load(b, RAX, LJIT_STACK, LJIT_SLOT(k - n - 1));
+  ljit_check(a, b);
+  ljit_load_consts(b);
+}
+
+/* Call the function below the top 2 of the k values, expected to be op,
+ * one of builtin_add, builtin_sub and builtin_mul, with level calls
+ * pending
+ * On two fixnums the operation is done inline on the tagged values: the
+ * tag makes the 64 bit operation overflow exactly when the result leaves
+ * the fixnum range, so that bails out to the call too.
+ */
+static void ljit_arith(ljit_asm* a, int k, lbuiltin op, int level,
+                       int tail) {
+  ljit_buf* b = &a->code;
+  int slow[5];
+
+  ljit_load(b, RCX, LJIT_STACK, LJIT_SLOT(k - 2));
+  ljit_load(b, RDX, LJIT_STACK, LJIT_SLOT(k - 1));
+  ljit_reg(b, 1, 0x89, RCX, RAX);               /* mov rax, rcx */
+  ljit_reg(b, 1, 0x21, RDX, RAX);               /* and rax, rdx */
+  ljit_byte(b, 0xa8);                           /* test al, 1 */
+  ljit_byte(b, 1);
+  slow[0] = ljit_jump(b, LJIT_JE);
+
+  ljit_load(b, RAX, LJIT_STACK, LJIT_SLOT(k - 3));
+  ljit_byte(b, 0xa8);                           /* test al, 1 */
+  ljit_byte(b, 1);
+  slow[1] = ljit_jump(b, LJIT_JNE);
+  ljit_mem(b, 0, 0x83, 7, RAX, offsetof(lval, type));   /* cmp dword */
+  ljit_byte(b, LVAL_FUN);
+  slow[2] = ljit_jump(b, LJIT_JNE);
+  ljit_movabs(b, R8, (void*)op);
+  ljit_mem(b, 1, 0x39, R8, RAX, offsetof(lval, value.fun.call));
+  slow[3] = ljit_jump(b, LJIT_JNE);
+
+  if (op == builtin_add) {
+    /* 2x+1 + 2y+1 - 1 */
+    ljit_reg(b, 1, 0x83, 5, RDX);               /* sub rdx, 1 */
+    ljit_byte(b, 1);
+    ljit_reg(b, 1, 0x01, RDX, RCX);             /* add rcx, rdx */
+    slow[4] = ljit_jump(b, LJIT_JO);
+  } else if (op == builtin_sub) {
+    /* 2x+1 - (2y+1) + 1 */
+    ljit_reg(b, 1, 0x29, RDX, RCX);             /* sub rcx, rdx */
+    slow[4] = ljit_jump(b, LJIT_JO);
+    ljit_reg(b, 1, 0x83, 1, RCX);               /* or rcx, 1 */
+    ljit_byte(b, 1);
+  } else {
+    /* x * 2y + 1 */
+    ljit_reg(b, 1, 0xd1, 7, RCX);               /* sar rcx, 1 */
+    ljit_reg(b, 1, 0x83, 5, RDX);               /* sub rdx, 1 */
+    ljit_byte(b, 1);
+    ljit_reg(b, 1, 0x0faf, RCX, RDX);           /* imul rcx, rdx */
+    slow[4] = ljit_jump(b, LJIT_JO);
+    ljit_reg(b, 1, 0x83, 1, RCX);               /* or rcx, 1 */
+    ljit_byte(b, 1);
+  }
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k - 3), RCX);
+  int done = b->count;
+
+  /* Bail out to the VM */
+  for (int i = 0; i < 5; i++) { ljit_to_cold(a, slow[i]); }
+  b = &a->cold;
+  ljit_movabs(b, RAX, &ljit.bailouts);
+  ljit_mem(b, 1, 0xff, 0, RAX, 0);              /* inc qword [rax] */
+  ljit_movabs(b, RAX, &a->native->bailouts);
+  ljit_mem(b, 0, 0xff, 0, RAX, 0);              /* inc dword [rax] */
+  ljit_vm_call(a, b, k, 2, level, tail);
+  ljit_to_code(a, done);
+}
+
+/* Truth of x for the test templates */
+static int ljit_truth(lval* x) {
+  return !lval_is_false(x);
+}
+
+/* Jump with condition cc to bytecode offset o with k values on the stack,
+ * or to the end of the template when o is -1, adding the jump to end
+ */
+static void ljit_test_to(ljit_asm* a, int cc, lword o, int k, int* end,
+                         int* n) {
+  if (o >= 0) { ljit_to_op(a, cc, o, k); }
+  else { end[(*n)++] = ljit_jump(&a->code, cc); }
+}
+
+/* Test the top of the k values for BRANCH, AND or OR at ip
+ * Immediate numbers are told apart inline, other values by ljit_truth.
+ */
+static void ljit_test(ljit_asm* a, int op, int k, lword* ip) {
+  ljit_buf* b = &a->code;
+  int end[3];
+  int n = 0;
+
+  /* Where false and true values go, -1 past the template */
+  lword no = op == LOP_OR ? -1 : ip[0];
+  lword yes = op == LOP_OR ? ip[0] : -1;
+  int kno = op == LOP_BRANCH ? k - 1 : k;
+
+  ljit_load(b, RDI, LJIT_STACK, LJIT_SLOT(k - 1));
+  ljit_reg(b, 1, 0x83, 7, RDI);                 /* cmp rdi, fixnum 0 */
+  ljit_byte(b, (int)(uintptr_t)lval_fixnum(0));
+  ljit_test_to(a, LJIT_JE, no, kno, end, &n);
+  ljit_reg(b, 0, 0xf7, 0, RDI);                 /* test edi, 1 */
+  ljit_imm32(b, 1);
+  ljit_test_to(a, LJIT_JNE, yes, k, end, &n);
+  ljit_call(b, (void*)ljit_truth);
+  ljit_reg(b, 0, 0x85, RAX, RAX);               /* test eax, eax */
+  ljit_test_to(a, LJIT_JE, no, kno, end, &n);
+  if (yes >= 0) { ljit_to_op(a, LJIT_JMP, yes, k); }
+  for (int i = 0; i < n; i++) { ljit_patch(b, end[i], b->count); }
+}
+
+/* Start the loop of the given kind for DOTIMES or FOREACH at ip, on the
+ * top of the k values
+ */
+static void ljit_enter(ljit_asm* a, int kind, int k, lword* ip) {
+  ljit_buf* b = &a->code;
+  ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+  ljit_byte(b, 0xbe);                           /* mov esi, kind */
+  ljit_imm32(b, kind);
+  ljit_load(b, RDX, LJIT_CONSTS, LJIT_SLOT(ip[0]));
+  ljit_load(b, RCX, LJIT_STACK, LJIT_SLOT(k - 1));
+  ljit_call(b, (void*)lform_enter);
+  ljit_reg(b, 1, 0x85, RAX, RAX);               /* test rax, rax */
+  int entered = ljit_jump(b, LJIT_JE);
+  ljit_check(a, b);
+  ljit_store(b, LJIT_STACK, LJIT_SLOT(k - 1), RAX);
+  ljit_to_op(a, LJIT_JMP, ip[1], k);
+  ljit_patch(b, entered, b->count);
+}
+
+/* Step the loop of the given kind for STEP or EACH at ip, with k values
+ * on the stack
+ * A count of two fixnums is stepped inline on their tagged values, other
+ * steps are left to lform_step.
+ */
+static void ljit_step(ljit_asm* a, int kind, int k, lword* ip) {
+  ljit_buf* b = &a->code;
+  int slow = -1;
+  int done = -1;
+
+  if (kind == LFORM_DOTIMES) {
+    ljit_load(b, RSI, LJIT_ENV, offsetof(lenv, frame));
+    ljit_load(b, RSI, RSI, offsetof(lframe, slots));
+    ljit_load(b, RCX, RSI, 0);
+    ljit_load(b, RDX, RSI, 8);
+    ljit_reg(b, 1, 0x89, RCX, RAX);             /* mov rax, rcx */
+    ljit_reg(b, 1, 0x21, RDX, RAX);             /* and rax, rdx */
+    ljit_byte(b, 0xa8);                         /* test al, 1 */
+    ljit_byte(b, 1);
+    slow = ljit_jump(b, LJIT_JE);
+    ljit_reg(b, 1, 0x83, 0, RCX);               /* add rcx, fixnum 1 */
+    ljit_byte(b, 2);
+    ljit_reg(b, 1, 0x39, RDX, RCX);             /* cmp rcx, rdx */
+    done = ljit_jump(b, LJIT_JGE);
+    ljit_store(b, RSI, 0, RCX);
+    ljit_to_op(a, LJIT_JMP, ip[0], k);
+  } else {
+    ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+    ljit_byte(b, 0xbe);                         /* mov esi, kind */
+    ljit_imm32(b, kind);
+    ljit_call(b, (void*)lform_step);
+  }
+  int again = b->count;
+  ljit_reg(b, 0, 0x85, RAX, RAX);               /* test eax, eax */
+  ljit_to_op(a, LJIT_JNE, ip[0], k);
+  if (slow < 0) { return; }
+  ljit_patch(b, done, b->count);
+
+  /* lform_step(e, kind), tested by the code */
+  ljit_to_cold(a, slow);
+  b = &a->cold;
+  ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+  ljit_byte(b, 0xbe);                           /* mov esi, kind */
+  ljit_imm32(b, kind);
+  ljit_call(b, (void*)lform_step);
+  ljit_to_code(a, again);
+}
+
+/* Make ip[0] calls pending in the run for DEPTH at ip, unless as many
+ * are, leaving the run with the error past the limit
+ */
+static void ljit_depth(ljit_asm* a, lword* ip) {
+  ljit_buf* b = &a->code;
+  ljit_movabs(b, RCX, &lvm_depth_base);
+  ljit_mem(b, 0, 0x8b, RAX, RCX, 0);            /* mov eax, [rcx] */
+  ljit_reg(b, 0, 0x81, 0, RAX);                 /* add eax, n */
+  ljit_imm32(b, (int32_t)ip[0]);
+  ljit_movabs(b, RCX, &lvm_depth);
+  ljit_mem(b, 0, 0x3b, RAX, RCX, 0);            /* cmp eax, [rcx] */
+  int more = ljit_jump(b, LJIT_JG);
+  int done = b->count;
+
+  /* reach(n), an error or NULL */
+  ljit_to_cold(a, more);
+  b = &a->cold;
+  ljit_byte(b, 0xbf);                           /* mov edi, n */
+  ljit_imm32(b, (int32_t)ip[0]);
+  ljit_call(b, (void*)ljit_host->reach);
+  ljit_reg(b, 1, 0x85, RAX, RAX);               /* test rax, rax */
+  ljit_patch(b, ljit_jump(b, LJIT_JNE), 0);
+  ljit_to_code(a, done);
+}
+
+/* Save the registers the templates keep and set them for running c in
+ * e, the arguments, with the VM stack at the height it has now
+ */
+static void ljit_prologue(ljit_buf* b, const ljit_vm* vm) {
+  /* Five pushes keep the C stack aligned for calls */
+  ljit_byte(b, 0x53);                           /* push rbx */
+  for (int r = R12; r <= R15; r++) { ljit_opcode(b, 0, 0x50 + (r & 7), 0, r); }
+  ljit_reg(b, 1, 0x89, RDI, LJIT_ENV);
+  ljit_reg(b, 1, 0x89, RSI, LJIT_CODE);
+  ljit_movabs(b, LJIT_VERSION, &lenv_version);
+  ljit_load_consts(b);
+  ljit_movabs(b, RAX, vm->stack);
+  ljit_load(b, RAX, RAX, 0);
+  ljit_movabs(b, RCX, vm->sp);
+  ljit_mem(b, 1, 0x63, RCX, RCX, 0);            /* movsxd rcx, [rcx] */
+  ljit_byte(b, 0x4c);                           /* lea r13, [rax+rcx*8] */
+  ljit_byte(b, 0x8d);
+  ljit_byte(b, 0x2c);
+  ljit_byte(b, 0xc8);
+}
+
+/* Restore the registers the prologue saved and return rax */
+static void ljit_epilogue(ljit_buf* b) {
+  for (int r = R15; r >= R12; r--) { ljit_opcode(b, 0, 0x58 + (r & 7), 0, r); }
+  ljit_byte(b, 0x5b);                           /* pop rbx */
+  ljit_byte(b, 0xc3);                           /* ret */
+}
+
+/* Builtin done inline that the CALLEE operands at ip found, or NULL
+ * The cache is only trusted while the bindings have not changed.
+ */
+static lbuiltin ljit_known(lword* ip) {
+  if (ip == NULL || ip[1] != lenv_version) { return NULL; }
+  lval* f = (lval*)ip[3];
+  if (lval_type(f) != LVAL_FUN) { return NULL; }
+  lbuiltin call = f->value.fun.call;
+  if (call == builtin_add || call == builtin_sub || call == builtin_mul) {
+    return call;
+  }
+  return NULL;
+}
+
+/* Translate c into c->native, return 0 if it cannot be
+ * Calls are translated for the function the inline caches of the bytecode
+ * found for them, tracked here across the stack: only those found to be
+ * arithmetic get an inline template.
+ */
+int ljit_compile(lcode* c, const ljit_vm* vm) {
+  if (ljit.bytes >= LJIT_CODE_LIMIT) {
+    ljit.refused++;
+    return 0;
+  }
+
+  ljit_native* native = malloc(sizeof(ljit_native));
+  ljit_asm a = { { NULL, 0, 0 }, { NULL, 0, 0 }, NULL, 0, 0, native,
+                 malloc(sizeof(int) * c->count),
+                 malloc(sizeof(int) * c->count) };
+  for (int i = 0; i < c->count; i++) { a.depths[i] = -1; }
+  ljit_buf* b = &a.code;
+  lval** consts = c->consts->value.cell;
+  ljit_host = vm;
+
+  /* Operands of the CALLEE that pushed each value, or NULL */
+  lword** callee = calloc(c->max_stack + 1, sizeof(lword*));
+  int k = 0;
+  int ok = 1;
+
+  ljit_prologue(b, vm);
+
+  /* Exit on an error, in rax, at the start of the cold part */
+  ljit_epilogue(&a.cold);
+
+  /* Entry of ljit_resume, jumping to the position in rdx */
+  int resume = a.cold.count;
+  ljit_prologue(&a.cold, vm);
+  ljit_reg(&a.cold, 0, 0xff, 4, RDX);           /* jmp rdx */
+
+  for (int i = 0; i < c->count && ok; ) {
+    /* Jump targets take the stack depth of the jumps reaching them */
+    a.offsets[i] = b->count;
+    if (a.depths[i] >= 0) {
+      k = a.depths[i];
+      if (k > 0) { callee[k - 1] = NULL; }
+    }
+
+    int op = vm->decode(c->ops[i]);
+    lword* ip = &c->ops[i + 1];
+    i += 1 + vm->operands[op];
+
+    /* A call followed by RETURN is in tail position */
+    int tail = i < c->count && vm->decode(c->ops[i]) == LOP_RETURN;
+    int n = -1;
+    int level = 0;
+
+    switch (op) {
+      case LOP_CONST: ljit_const(b, k, ip[0], consts[ip[0]]); break;
+      case LOP_SYM: ljit_lookup(&a, k, ip[0], (void*)lenv_get); break;
+      case LOP_GLOBAL: ljit_lookup(&a, k, ip[0], (void*)lenv_get_ref); break;
+      case LOP_LOCAL: ljit_local(b, k, ip[0], ip[1]); break;
+      case LOP_CALLEE: ljit_callee(&a, k, ip); break;
+      case LOP_CALL:
+        n = (int)ip[0];
+        level = (int)ip[1];
+        break;
+
+      case LOP_CONST_CALL:
+        ljit_const(b, k, ip[0], consts[ip[0]]);
+        n = (int)ip[1];
+        level = (int)ip[2];
+        break;
+
+      case LOP_GLOBAL_CALL:
+        ljit_lookup(&a, k, ip[0], (void*)lenv_get_ref);
+        n = (int)ip[1];
+        level = (int)ip[2];
+        break;
+
+      case LOP_RETURN:
+        ljit_load(b, RAX, LJIT_STACK, LJIT_SLOT(k - 1));
+        ljit_epilogue(b);
+        k--;
+        continue;
+
+      /* The code after it still takes the error as pushed */
+      case LOP_FAIL:
+        ljit_load(b, RAX, LJIT_CONSTS, LJIT_SLOT(ip[0]));
+        ljit_fixup_add(&a, LJIT_TO_COLD, ljit_jump(b, LJIT_JMP), 0);
+        break;
+
+      case LOP_JUMP:
+      case LOP_LOOP:
+        ljit_to_op(&a, LJIT_JMP, ip[0], k);
+        continue;
+
+      case LOP_BRANCH:
+      case LOP_AND:
+      case LOP_OR:
+        ljit_test(&a, op, k, ip);
+        k--;
+        continue;
+
+      case LOP_DROP:
+        k--;
+        continue;
+
+      case LOP_DOTIMES:
+      case LOP_FOREACH:
+        ljit_enter(&a, op == LOP_DOTIMES ? LFORM_DOTIMES : LFORM_FOREACH,
+                   k, ip);
+        k--;
+        continue;
+
+      case LOP_STEP:
+      case LOP_EACH:
+        ljit_step(&a, op == LOP_STEP ? LFORM_DOTIMES : LFORM_FOREACH, k, ip);
+        continue;
+
+      case LOP_LEAVE:
+        ljit_reg(b, 1, 0x89, LJIT_ENV, RDI);
+        ljit_call(b, (void*)lframe_leave);
+        continue;
+
+      case LOP_DEPTH:
+        ljit_depth(&a, ip);
+        continue;
+
+      default:
+        ok = 0;
+        continue;
+    }
+
+    /* Values pushed, by CALLEE only with a function */
+    if (op != LOP_CALL) { callee[k++] = op == LOP_CALLEE ? ip : NULL; }
+    if (n < 0) { continue; }
+
+    /* Calls replace their function and arguments with the result */
+    lbuiltin known = n == 2 ? ljit_known(callee[k - 3]) : NULL;
+    if (known) { ljit_arith(&a, k, known, level, tail); }
+    else { ljit_vm_call(&a, b, k, n, level, tail); }
+    k -= n;
+    callee[k - 1] = NULL;
+  }
+  free(callee);
+
+  void* p = NULL;
+  if (ok) {
+    ljit_join(&a);
+    if (ljit.bytes + a.code.count > LJIT_CODE_LIMIT) { ljit.refused++; }
+    else { p = ljit_place(a.code.bytes, a.code.count); }
+  }
+  free(a.code.bytes);
+  free(a.cold.bytes);
+  free(a.fixups);
+  free(a.depths);
+  if (p == NULL) {
+    free(a.offsets);
+    free(native);
+    return 0;
+  }
+
+  native->code = (ljit_code)p;
+  native->size = a.code.count;
+  native->bailouts = 0;
+  native->resume = a.code.count - a.cold.count + resume;
+  native->offsets = a.offsets;
+  c->native = native;
+  ljit.compiled++;
+  ljit.bytes += a.code.count;
+  return 1;
+}
+
+/* Run the native code of c in e from the instruction at offset o */
+lval* ljit_resume(lenv* e, lcode* c, int o) {
+  typedef lval* (*ljit_entry)(lenv* e, lcode* c, void* at);
+  unsigned char* p = (unsigned char*)c->native->code;
+  ljit_entry entry = (ljit_entry)(p + c->native->resume);
+  return entry(e, c, p + c->native->offsets[o]);
+}
+
+/* Release the native code of c */
+void ljit_free(lcode* c) {
+  if (c->native) {
+    ljit_unplace((unsigned char*)c->native->code, c->native->size);
+    ljit.bytes -= c->native->size;
+    free(c->native->offsets);
+    free(c->native);
+  }
+  c->native = NULL;
+}
+
+#else
+
+int ljit_compile(lcode* c, const ljit_vm* vm) {
+  return 0;
+}
+
+lval* ljit_resume(lenv* e, lcode* c, int o) {
+  return NULL;
+}
+
+void ljit_free(lcode* c) {
+}
+
+#endif
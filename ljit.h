@@ -0,0 +1,93 @@
+#if !defined(__LJIT_H__)
+#define __LJIT_H__
+
+#include "lvm.h"
+
+/* Native code
+ *
+ * Cached bytecode that has run enough times, or bytecode whose loops
+ * jumped back enough times in a run (see ltier in lvm.h), is
+ * translated into x86-64 machine code, in memory mapped for it, by pasting a fixed
+ * template for each instruction. The templates keep the VM stack in
+ * memory and call back into the VM for lookups and calls. A call whose
+ * inline cache found +, - or * gets an inline template instead: on two
+ * fixnums it is done in place once guards on the function and the
+ * operands pass, and it bails out to the call the bytecode makes when
+ * they fail or the result leaves the fixnum range. Bailouts are counted
+ * per translation, so that the VM can drop code whose guards keep failing.
+ *
+ * Native code is only generated on x86-64 Linux. Build with -DLVM_NO_JIT,
+ * or set LISPY_JIT=0 in the environment, to run bytecode only.
+ */
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LVM_NO_JIT)
+#define LJIT_X86_64
+#endif
+
+/* Runs of cached bytecode before it is translated, by default */
+#if !defined(LJIT_HOT_RUNS)
+#define LJIT_HOT_RUNS 8
+#endif
+
+/* Bytes of native code kept at most
+ * Template code is several times larger than bytecode: past what caches
+ * hold it runs slower, so hot code beyond this stays bytecode.
+ */
+#if !defined(LJIT_CODE_LIMIT)
+#define LJIT_CODE_LIMIT (128 * 1024)
+#endif
+
+/* Native code of some lcode c, run in place of lvm_exec */
+typedef lval* (*ljit_code)(lenv* e, lcode* c);
+
+/* Translation of some lcode */
+typedef struct ljit_native {
+  ljit_code code;
+  int size;
+  int bailouts;         /* inline calls bailed out since translated */
+  int resume;           /* position of the entry taken by ljit_resume */
+  int* offsets;         /* position of each instruction of the bytecode */
+} ljit_native;
+
+/* What native code uses of the VM */
+typedef struct ljit_vm {
+  lval*** stack;        /* the VM stack */
+  int* sp;              /* and its height */
+  lval* (*call)(lenv* e, int n, int level, int tail); /* CALL n level */
+  void (*callee)(lenv* e, lval** consts, lword* ip);  /* CALLEE cache miss */
+  lval* (*reach)(int n);                              /* DEPTH n, past the
+                                                         calls pending */
+  int (*decode)(lword w);                             /* opcode of a word */
+  const int* operands;  /* operands taken by each opcode */
+} ljit_vm;
+
+/* Native code is generated unless this is 0, see LISPY_JIT */
+extern int ljit_enabled;
+
+typedef struct ljit_stats {
+  long compiled;        /* codes translated */
+  long bytes;           /* machine code kept now */
+  long refused;         /* hot codes left as bytecode, past the limit */
+  long bailouts;        /* arithmetic calls not done inline */
+} ljit_stats;
+
+/* Translate c into c->native, return 0 if it cannot be */
+int ljit_compile(lcode* c, const ljit_vm* vm);
+
+/* Run the native code of c in e from the instruction at offset o, the
+ * head of a loop, with the values the bytecode left on the VM stack
+ * before it
+ * The values start at the stack height the run started at.
+ */
+lval* ljit_resume(lenv* e, lcode* c, int o);
+
+/* Release the native code of c */
+void ljit_free(lcode* c);
+
+/* Fill s with the native code statistics */
+void ljit_get_stats(ljit_stats* s);
+
+/* Print the native code statistics */
+void ljit_print_stats(void);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include "lresolve.h"
+#include "lgc.h"
+#include "lform.h"
+
+/* Reference to symbol k, bound in scope s or global */
+static lval* lresolve_sym(lscope* s, lval* k) {
+  for (int depth = 0; s; s = s->parent, depth++) {
+    for (int i = 0; i < s->count; i++) {
+      if (s->syms[i] == k) { return lval_ref(k, depth, i); }
+    }
+  }
+  return lval_ref(k, -1, -1);
+}
+
+/* List whose elements are rewritten from element from on, seen from s */
+typedef struct lresolve_item {
+  lval* l;
+  lscope* s;
+  int from;
+} lresolve_item;
+
+/* Grow work, holding *capacity items, to hold at least n */
+static lresolve_item* lresolve_reserve(lresolve_item* work, int* capacity,
+                                       int n) {
+  if (n <= *capacity) { return work; }
+  while (n > *capacity) { *capacity = *capacity ? *capacity * 2 : 64; }
+  return realloc(work, sizeof(lresolve_item) * *capacity);
+}
+
+/* Rewrite the symbols of code v, seen from scope s (NULL at top level)
+ * Nested lists are rewritten from a worklist rather than by recursion.
+ * The scopes of loops are only kept until the worklist is done.
+ */
+lval* lval_resolve(lscope* s, lval* v) {
+  static lresolve_item* work = NULL;
+  static int capacity = 0;
+  static lscope** scopes = NULL;
+  static int scopes_capacity = 0;
+  int scopes_count = 0;
+
+  if (lval_type(v) == LVAL_SYM) { return lresolve_sym(s, v); }
+
+  /* Quoted code and self evaluating values are left alone */
+  if (lval_type(v) != LVAL_LIST) { return v; }
+
+  int n = 0;
+  work = lresolve_reserve(work, &capacity, 1);
+  work[n++] = (lresolve_item){ v, s, 0 };
+  while (n > 0) {
+    lresolve_item it = work[--n];
+    lval* l = it.l;
+    work = lresolve_reserve(work, &capacity, n + l->count);
+
+    /* The binding of a loop is seen from outside, its bodies from a scope
+     * binding its variable
+     */
+    int kind = it.from == 0 ? lform_kind(l) : LFORM_NONE;
+    int to = l->count;
+    if ((kind == LFORM_DOTIMES || kind == LFORM_FOREACH) &&
+        lform_check(l, kind) == NULL) {
+      if (scopes_count == scopes_capacity) {
+        scopes_capacity = scopes_capacity ? scopes_capacity * 2 : 16;
+        scopes = realloc(scopes, sizeof(lscope*) * scopes_capacity);
+      }
+      lscope* scope = malloc(sizeof(lscope) + sizeof(lval*));
+      scope->parent = it.s;
+      scope->count = 1;
+      scope->syms = (lval**)(scope + 1);
+      scope->syms[0] = lform_var(l);
+      scopes[scopes_count++] = scope;
+
+      work[n++] = (lresolve_item){ l->value.cell[1], it.s, 1 };
+      work[n++] = (lresolve_item){ l, scope, 2 };
+      to = 1;
+    }
+
+    for (int i = it.from; i < to; i++) {
+      lval* x = l->value.cell[i];
+      if (lval_type(x) == LVAL_LIST) {
+        work[n++] = (lresolve_item){ x, it.s, 0 };
+        continue;
+      }
+      if (lval_type(x) != LVAL_SYM) { continue; }
+      x = lresolve_sym(it.s, x);
+      lgc_write_barrier(l, x);
+      l->value.cell[i] = x;
+    }
+  }
+
+  while (scopes_count > 0) { free(scopes[--scopes_count]); }
+  return v;
+}
+
+/* Frames left, kept for reuse by their slot count */
+#define LFRAME_KEPT 4
+static lframe* lframe_kept[LFRAME_KEPT + 1];
+
+/* Make a new frame of count slots, all NULL, the innermost frame of e */
+lframe* lframe_enter(lenv* e, int count) {
+  lframe* f = count <= LFRAME_KEPT ? lframe_kept[count] : NULL;
+  if (f) {
+    lframe_kept[count] = f->parent;
+  } else {
+    f = malloc(sizeof(lframe) + 2 * sizeof(lval*) * count);
+    f->count = count;
+    f->slots = (lval**)(f + 1);
+    f->syms = f->slots + count;
+  }
+  for (int i = 0; i < count; i++) {
+    f->slots[i] = NULL;
+    f->syms[i] = NULL;
+  }
+  f->parent = e->frame;
+  e->frame = f;
+  return f;
+}
+
+/* Remove the innermost frame of e
+ * A symbol no frame binds by name any more loses LVAL_F_LOCAL, and code
+ * that could not fold its global binding meanwhile is folded again.
+ */
+void lframe_leave(lenv* e) {
+  lframe* f = e->frame;
+  e->frame = f->parent;
+  for (int i = 0; i < f->count; i++) {
+    lval* k = f->syms[i];
+    if (k && --k->count == 0) {
+      k->flags &= ~LVAL_F_LOCAL;
+      if (lenv_index(e, k) >= 0) { lenv_const_version++; }
+    }
+  }
+  if (f->count <= LFRAME_KEPT) {
+    f->parent = lframe_kept[f->count];
+    lframe_kept[f->count] = f;
+  } else {
+    free(f);
+  }
+}
+
+/* Bind slot i of the innermost frame of e to symbol k by name
+ * The count of a symbol is the number of frames binding it. Once k is
+ * bound, code folded or cached against its global binding, if it has
+ * one, is made stale.
+ */
+void lframe_bind(lenv* e, int i, lval* k) {
+  e->frame->syms[i] = k;
+  if (k->count++ == 0) {
+    k->flags |= LVAL_F_LOCAL;
+    if (lenv_index(e, k) >= 0) {
+      lenv_version++;
+      lenv_const_version++;
+    }
+  }
+}
+
+/* Innermost slot of the frames of e bound to k by name, or NULL */
+lval** lframe_find(lenv* e, lval* k) {
+  for (lframe* f = e->frame; f; f = f->parent) {
+    for (int i = 0; i < f->count; i++) {
+      if (f->syms[i] == k) { return &f->slots[i]; }
+    }
+  }
+  return NULL;
+}
+
+/* Value a reference refers to in e */
+lval* lenv_get_ref(lenv* e, lval* r) {
+  lref* ref = &r->value.ref;
+
+  /* Local: go up depth frames and index the slot */
+  if (ref->depth >= 0) {
+    lframe* f = e->frame;
+    for (int d = 0; d < ref->depth; d++) { f = f->parent; }
+    return f->slots[ref->slot];
+  }
+
+  /* A global may be bound by name in a frame, see lframe_bind */
+  if (e->frame && (ref->sym->flags & LVAL_F_LOCAL)) {
+    lval** x = lframe_find(e, ref->sym);
+    if (x) { return *x; }
+  }
+
+  /* Global: try the position the binding had last time */
+  if (ref->slot >= 0 && ref->slot < e->count &&
+      e->vars[ref->slot].sym == ref->sym) {
+    return e->vars[ref->slot].val;
+  }
+  ref->slot = lenv_index(e, ref->sym);
+  if (ref->slot < 0) { return &lerr_unbound; }
+  return e->vars[ref->slot].val;
+}
@@ -0,0 +1,64 @@
+#if !defined(__LRESOLVE_H__)
+#define __LRESOLVE_H__
+
+#include "lval.h"
+
+/* Lexical addressing
+ *
+ * The resolver runs over code returned by lval_read before it is
+ * evaluated and rewrites every symbol in an evaluated position into an
+ * LVAL_REF value. A symbol bound by an enclosing binding form becomes a
+ * (depth, slot) reference into the chain of local frames, found at run
+ * time by indexing instead of by name. Any other symbol is a free
+ * variable and becomes a global reference, looked up in the environment
+ * and remembering the position of its binding there.
+ *
+ * Quoted code is data and is left as is: it is only resolved, if ever,
+ * by whoever evaluates it.
+ */
+
+/* Compile time scope: the symbols bound by one binding form */
+typedef struct lscope {
+  struct lscope* parent;
+  int count;
+  lval** syms;          /* interned symbols, slot i binds syms[i] */
+} lscope;
+
+/* Run time frame of a scope, slot i holds the value of its i-th symbol
+ * Frames are kept by their environment, innermost first, and their slots
+ * are collector roots while they are in it. A slot may also be bound to
+ * its symbol by name: code that is not resolved, such as code evaluated
+ * with eval, finds it there before the global binding. Such symbols are
+ * flagged LVAL_F_LOCAL while a frame binds them, so that their global
+ * bindings are not folded or cached meanwhile.
+ */
+struct lframe {
+  struct lframe* parent;
+  int count;
+  lval** slots;
+  lval** syms;          /* symbol bound by name to each slot, or NULL */
+};
+
+/* Rewrite the symbols of code v, seen from scope s (NULL at top level)
+ * v must be freshly read code, its lists are changed in place. The loops
+ * of lform.h bind their variable in slot 0 of a scope of their own, for
+ * their bodies.
+ */
+lval* lval_resolve(lscope* s, lval* v);
+
+/* Make a new frame of count slots, all NULL, the innermost frame of e */
+lframe* lframe_enter(lenv* e, int count);
+
+/* Remove the innermost frame of e */
+void lframe_leave(lenv* e);
+
+/* Bind slot i of the innermost frame of e to symbol k by name */
+void lframe_bind(lenv* e, int i, lval* k);
+
+/* Innermost slot of the frames of e bound to k by name, or NULL */
+lval** lframe_find(lenv* e, lval* k);
+
+/* Value a reference refers to in e */
+lval* lenv_get_ref(lenv* e, lval* r);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lsym.h"
+
+#define LSYM_MIN_CAPACITY 256
+
+static struct {
+  lval** slots;
+  unsigned long* hashes;
+  long capacity;
+  long count;
+  long lookups;
+  long probes;
+  long max_probe;
+  size_t bytes;
+} lsym;
+
+static pthread_mutex_t lsym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a hash of s */
+static unsigned long lsym_hash(const char* s) {
+  unsigned long h = 2166136261UL;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/* Double the table, or create it */
+static void lsym_grow(void) {
+  long capacity = lsym.capacity ? lsym.capacity * 2 : LSYM_MIN_CAPACITY;
+  lval** slots = calloc(capacity, sizeof(lval*));
+  unsigned long* hashes = malloc(capacity * sizeof(unsigned long));
+  if (slots == NULL || hashes == NULL) {
+    perror("lispy: out of memory");
+    exit(1);
+  }
+
+  for (long i = 0; i < lsym.capacity; i++) {
+    if (lsym.slots[i] == NULL) { continue; }
+    long j = lsym.hashes[i] & (capacity - 1);
+    while (slots[j]) { j = (j + 1) & (capacity - 1); }
+    slots[j] = lsym.slots[i];
+    hashes[j] = lsym.hashes[i];
+  }
+
+  free(lsym.slots);
+  free(lsym.hashes);
+  lsym.slots = slots;
+  lsym.hashes = hashes;
+  lsym.capacity = capacity;
+}
+
+/* A new symbol value named s, its name is stored right after it */
+static lval* lsym_new(const char* s, size_t len) {
+  size_t n = sizeof(lval) + len + 1;
+  lval* v = malloc(n);
+  if (v == NULL) {
+    perror("lispy: out of memory");
+    exit(1);
+  }
+  v->type = LVAL_SYM;
+  v->flags = 0;
+  v->mark = 0;
+  v->count = 0;
+  v->value.sym = (char*)(v + 1);
+  memcpy(v->value.sym, s, len + 1);
+  lsym.bytes += n;
+  return v;
+}
+
+/* The symbol named s, interned on first use */
+lval* lsym_intern(const char* s) {
+  unsigned long h = lsym_hash(s);
+
+  pthread_mutex_lock(&lsym_lock);
+  if (2 * (lsym.count + 1) > lsym.capacity) { lsym_grow(); }
+
+  long i = h & (lsym.capacity - 1);
+  long n = 1;
+  while (lsym.slots[i] &&
+         (lsym.hashes[i] != h || strcmp(lsym.slots[i]->value.sym, s) != 0)) {
+    i = (i + 1) & (lsym.capacity - 1);
+    n++;
+  }
+
+  lsym.lookups++;
+  lsym.probes += n;
+  if (n > lsym.max_probe) { lsym.max_probe = n; }
+
+  if (lsym.slots[i] == NULL) {
+    lsym.slots[i] = lsym_new(s, strlen(s));
+    lsym.hashes[i] = h;
+    lsym.count++;
+  }
+  lval* v = lsym.slots[i];
+  pthread_mutex_unlock(&lsym_lock);
+  return v;
+}
+
+/* Fill s with the intern table statistics */
+void lsym_get_stats(lsym_stats* s) {
+  pthread_mutex_lock(&lsym_lock);
+  s->count = lsym.count;
+  s->capacity = lsym.capacity;
+  s->lookups = lsym.lookups;
+  s->probes = lsym.probes;
+  s->max_probe = lsym.max_probe;
+  s->bytes = lsym.bytes + lsym.capacity * (sizeof(lval*) + sizeof(unsigned long));
+  pthread_mutex_unlock(&lsym_lock);
+}
+
+/* Print the intern table statistics */
+void lsym_print_stats(void) {
+  lsym_stats s;
+  lsym_get_stats(&s);
+
+  printf("symbols: %li in %li slots, %zu bytes\n",
+    s.count, s.capacity, s.bytes);
+  printf("lookups: %li, probes: average %.2f, max %li\n",
+    s.lookups, s.lookups ? (double)s.probes / s.lookups : 0.0, s.max_probe);
+}
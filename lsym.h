@@ -0,0 +1,35 @@
+#if !defined(__LSYM_H__)
+#define __LSYM_H__
+
+#include <stddef.h>
+#include "lval.h"
+
+/* Symbol intern table
+ *
+ * There is a single LVAL_SYM value per distinct name in the process, so
+ * symbols compare by pointer and are shared instead of copied. Interned
+ * symbols live outside of the collector heap and are never freed.
+ *
+ * The table uses open addressing with linear probing and is kept at most
+ * half full.
+ */
+
+typedef struct lsym_stats {
+  long count;       /* interned symbols */
+  long capacity;    /* slots in the table */
+  long lookups;     /* calls to lsym_intern */
+  long probes;      /* slots looked at by all lookups */
+  long max_probe;   /* slots looked at by the longest lookup */
+  size_t bytes;     /* memory held by symbols and the table */
+} lsym_stats;
+
+/* The symbol named s, interned on first use */
+lval* lsym_intern(const char* s);
+
+/* Fill s with the intern table statistics */
+void lsym_get_stats(lsym_stats* s);
+
+/* Print the intern table statistics */
+void lsym_print_stats(void);
+
+#endif
@@ -4,11 +4,20 @@
 #include <assert.h>
 #include <stdarg.h>
 #include "lval.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lsym.h"
+#include "lresolve.h"
 
 
 /* Construct a pointer to a new Number lval */ 
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  /* Most numbers fit in an immediate and never touch the heap */
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return lval_fixnum(x);
+  }
+
+  lval* v = lgc_alloc();
   v->type = LVAL_NUM;
   v->value.num = x;
   return v;
@@ -24,40 +33,91 @@ char* ltype_name(int t) {
     case LVAL_SYM: return "Symbol";
     case LVAL_LIST: return "List";
     case LVAL_QEXPR: return "Q-Expr";
+    case LVAL_REF: return "Symbol";
     default: return "Unknown";
   }
 }
 
 
-/* Construct a pointer to a new Error lval */ 
+/* Conversions an error message takes at most */
+#define LERR_MAX_ARGS 8
+
+/* Construct a pointer to a new Error lval
+ * Most errors are never printed, so the message is not formatted here:
+ * the arguments are kept as values instead, numbers for %i and %li and
+ * the string pointer itself for %s, and lval_print formats them with fmt.
+ * A pointer is kept as an immediate number, so the collector skips it.
+ */
 lval* lval_err(int code, char* fmt, ...) {
-  #define MSG_LEN 1024
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-  v->value.err.code = code;
-  v->value.err.msg  = malloc(MSG_LEN);
-  memset(v->value.err.msg, 0, MSG_LEN);
+  lval* args[LERR_MAX_ARGS];
+  int n = 0;
 
   va_list va;
   va_start(va, fmt);
-  vsnprintf(v->value.err.msg, MSG_LEN-1, fmt, va);
+  for (const char* p = fmt; (p = strchr(p, '%')) != NULL && n < LERR_MAX_ARGS; ) {
+    int wide = *++p == 'l';
+    if (wide) { p++; }
+    switch (*p) {
+      case 's':
+        args[n++] = lval_fixnum((intptr_t)va_arg(va, const char*));
+        break;
+      case 'i':
+      case 'd':
+        args[n++] = lval_num(wide ? va_arg(va, long) : va_arg(va, int));
+        break;
+    }
+    if (*p) { p++; }
+  }
   va_end(va);
 
+  lval* v = lgc_alloc();
+  v->type = LVAL_ERR;
+  v->count = code;
+  v->value.err.fmt = fmt;
+  v->value.err.args = n ? lval_list_from(n, args) : NULL;
   return v;
 }
 
-/* Construct a pointer to a new Symbol lval */ 
+/* Print the message of error v, formatting its arguments */
+static void lval_print_err(lval* v) {
+  lval** args = v->value.err.args ? v->value.err.args->value.cell : NULL;
+  int n = v->value.err.args ? v->value.err.args->count : 0;
+  int i = 0;
+
+  for (const char* p = v->value.err.fmt; *p; p++) {
+    if (*p != '%') {
+      putchar(*p);
+      continue;
+    }
+    if (p[1] == 'l') { p++; }
+    if (*++p == '\0') { break; }
+    if (*p == '%' || i == n) {
+      putchar(*p);
+      continue;
+    }
+    long x = lval_num_value(args[i++]);
+    if (*p == 's') { printf("%s", (const char*)(intptr_t)x); }
+    else { printf("%li", x); }
+  }
+}
+
+/* Preallocated errors, never tracked by the collector */
+lval lerr_unbound = {
+  LVAL_ERR, 0, { .err = { "unbound symbol!", NULL } }, LERR_ERR, 0
+};
+lval lerr_not_function = {
+  LVAL_ERR, 0, { .err = { "List does not start with symbol", NULL } },
+  LERR_BAD_LIST, 0
+};
+
+/* Get the Symbol lval named s, symbols are interned */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->value.sym = malloc(strlen(s) + 1);
-  strcpy(v->value.sym, s);
-  return v;
+  return lsym_intern(s);
 }
 
 /* A pointer to a new empty list lval */
 lval* lval_list(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lgc_alloc();
   v->type = LVAL_LIST;
   v->count = 0;
   v->value.cell = NULL;
@@ -66,7 +126,7 @@ lval* lval_list(void) {
 
 /* A pointer to a new empty qexpr lval */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lgc_alloc();
   v->type = LVAL_QEXPR;
   v->value.qexpr = NULL;
   return v;
@@ -74,120 +134,149 @@ lval* lval_qexpr(void) {
 
 /* Create a pointer to a new Function lval */
 lval *lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lgc_alloc();
   v->type = LVAL_FUN;
-  v->value.fun  = func;
+  v->value.fun.call = func;
+  v->value.fun.list = NULL;
   return v;
 }
 
-/* Free var of lval type */
-void lval_del(lval* v) {
+/* Call the list builtin of argv[-1] with a new list of the arguments */
+static lval* lval_call_list(lenv* e, int argc, lval** argv) {
+  lbuiltin_list func = argv[-1]->value.fun.list;
+  return func(e, lval_list_from(argc, argv));
+}
 
-  switch (v->type) {
-    /* Do nothing special for number type */
-    case LVAL_NUM: 
-      break;
-    case LVAL_ERR:
-      free(v->value.err.msg);
-      break;
-    
-    /* For Sym free the string data */
-    case LVAL_SYM: 
-      free(v->value.sym); 
-      break;
-    
-    /* If List then delete all elements inside */
-    case LVAL_LIST:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->value.cell[i]);
-      }
-      /* Also free the memory allocated to contain the pointers */
-      free(v->value.cell);
-    break;
+/* Create a Function lval calling func with its arguments as a list */
+lval* lval_fun_list(lbuiltin_list func) {
+  lval* v = lval_fun(lval_call_list);
+  v->value.fun.list = func;
+  return v;
+}
 
-    case LVAL_QEXPR:
-      if (v->value.qexpr != NULL)
-        lval_del(v->value.qexpr);
-      break;
-    
-    case LVAL_FUN:
-      break;
-  }
-  
-  /* Free the memory allocated for the "lval" struct itself */
-  free(v);
+/* Create a reference to symbol k at (depth, slot) */
+lval* lval_ref(lval* k, int depth, int slot) {
+  lval* v = lgc_alloc();
+  v->type = LVAL_REF;
+  v->value.ref.sym = k;
+  v->value.ref.depth = depth;
+  v->value.ref.slot = slot;
+  return v;
+}
+
+/* Grow the array *a of *capacity values to hold at least n */
+static void lval_reserve(lval*** a, int* capacity, int n) {
+  if (n <= *capacity) { return; }
+  while (n > *capacity) { *capacity = *capacity ? *capacity * 2 : 64; }
+  *a = realloc(*a, sizeof(lval*) * *capacity);
 }
 
-/* Copy a lval to a new lval */
-lval* lval_copy(lval* v) {
+/* Check whether v is in the nursery */
+static int lval_is_young(lval* v) {
+  return !lval_is_fixnum(v) && (v->flags & LVAL_F_ARENA);
+}
+
+/* Copy the top node of v to a new lval, sharing its sub elements */
+static lval* lval_copy_node(lval* v) {
 
-  lval* x = malloc(sizeof(lval));
+  lval* x = lgc_alloc();
   x->type = v->type;
+  x->flags |= v->flags & LVAL_F_KEPT;
 
   switch (v->type) {
 
     /* Copy Functions and Numbers Directly */
     case LVAL_FUN: x->value.fun = v->value.fun; break;
     case LVAL_NUM: x->value.num = v->value.num; break;
+    case LVAL_REF: x->value.ref = v->value.ref; break;
 
-    /* Copy Strings using malloc and strcpy */
+    /* Errors share their format and arguments */
     case LVAL_ERR:
-      x->value.err.code = v->value.err.code;
-      x->value.err.msg  = strdup(v->value.err.msg);
-      break;
-
-    case LVAL_SYM:
-      x->value.sym = strdup(v->value.sym);
+      x->count = v->count;
+      x->value.err = v->value.err;
       break;
 
-    /* Copy Lists by copying each sub-expression */
+    /* Copy the cells of Lists, lval_promote copies what they point to */
     case LVAL_LIST:
       x->count = v->count;
-      x->value.cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->value.cell[i] = lval_copy(v->value.cell[i]);
+      x->value.cell = lcells_alloc(x, x->count);
+      if (x->count) {
+        memcpy(x->value.cell, v->value.cell, sizeof(lval*) * x->count);
       }
       break;
     case LVAL_QEXPR:
-      x->value.qexpr = lval_copy(v->value.qexpr);
+      x->value.qexpr = v->value.qexpr;
       break;
   }
 
   return x;
 }
 
+/* Copy v out of the nursery
+ * Values already outside of it are shared instead of copied. The copies
+ * still pointing into the nursery are fixed from a worklist rather than
+ * by recursion, so deeply nested data does not exhaust the C stack.
+ */
+lval* lval_promote(lval* v) {
+  static lval** work = NULL;
+  static int capacity = 0;
+
+  if (!lval_is_young(v)) { return v; }
+
+  larena* nursery = larena_swap(NULL);
+  lval* x = lval_copy_node(v);
+  int n = 0;
+  lval_reserve(&work, &capacity, 1);
+  work[n++] = x;
+
+  while (n > 0) {
+    lval* y = work[--n];
+    if (y->type == LVAL_LIST) {
+      lval_reserve(&work, &capacity, n + y->count);
+      for (int i = 0; i < y->count; i++) {
+        if (lval_is_young(y->value.cell[i])) {
+          y->value.cell[i] = lval_copy_node(y->value.cell[i]);
+          work[n++] = y->value.cell[i];
+        }
+      }
+    } else if (y->type == LVAL_QEXPR || y->type == LVAL_ERR) {
+      /* The one value they point to, if any */
+      lval** c = y->type == LVAL_QEXPR ? &y->value.qexpr : &y->value.err.args;
+      if (*c && lval_is_young(*c)) {
+        lval_reserve(&work, &capacity, n + 1);
+        *c = lval_copy_node(*c);
+        work[n++] = *c;
+      }
+    }
+  }
+
+  larena_swap(nursery);
+  return x;
+}
+
 
-/* Add x to sub element of list v */
+/* Add x to sub element of list v, v must still be under construction */
 lval* lval_list_add(lval* v, lval* x) {
 
+  lgc_write_barrier(v, x);
+  v->value.cell = lcells_resize(v, v->value.cell, v->count, v->count+1);
   v->count++;
-  v->value.cell = realloc(v->value.cell, sizeof(lval*) * v->count);
   v->value.cell[v->count-1] = x;
   return v;
 }
 
-/* Pop up i-th sub element of list v */
-lval* lval_list_pop(lval* v, int i) {
-  /* Find the item at "i" */
-  lval* x = v->value.cell[i];
-  
-  /* Shift memory after the item at "i" over the top */
-  memmove(&v->value.cell[i], &v->value.cell[i+1],
-    sizeof(lval*) * (v->count-i-1));
-  
-  /* Decrease the count of items in the list */
-  v->count--;
-  
-  /* Reallocate the memory used */
-  v->value.cell = realloc(v->value.cell, sizeof(lval*) * v->count);
+/* New list of the n values of cells */
+lval* lval_list_from(int n, lval** cells) {
+  lval* x = lval_list();
+  x->count = n;
+  x->value.cell = lcells_alloc(x, n);
+  if (n) { memcpy(x->value.cell, cells, sizeof(lval*) * n); }
   return x;
 }
 
-/*Take i-th sub element and delete list v */
-lval* lval_list_take(lval* v, int i) {
-  lval* x = lval_list_pop(v, i);
-  lval_del(v);
-  return x;
+/* New list of the sub elements of v from the i-th on */
+lval* lval_list_tail(lval* v, int i) {
+  return lval_list_from(v->count - i, &v->value.cell[i]);
 }
 
 /* John two list */
@@ -195,35 +284,25 @@ lval* lval_list_take(lval* v, int i) {
 // (a b c) (d e) -> (a b c d e)
 lval* lval_list_join(lval* x, lval* y) {
 
-  while (y->count) {
-    x = lval_list_add(x, lval_list_pop(y, 0));
+  lval* v = lval_list();
+  v->count = x->count + y->count;
+  v->value.cell = lcells_alloc(v, v->count);
+  if (x->count) {
+    memcpy(v->value.cell, x->value.cell, sizeof(lval*) * x->count);
+  }
+  if (y->count) {
+    memcpy(&v->value.cell[x->count], y->value.cell, sizeof(lval*) * y->count);
   }
-
-  lval_del(y);  
-  return x;
-}
-
-/* Take sub element from qexpr, delete qexpr
- * qexpr -> list
- * '(a b c) -> (a b c)
- */
-lval* lval_qexpr_unquote(lval* q) {
-  assert(q->value.qexpr != NULL);
-  lval* v = q->value.qexpr;
-  q->value.qexpr = NULL;
-  lval_del(q);
   return v;
 }
 
-/* Pop sub element from qexpr (not free qexpr)
+/* Take sub element from qexpr
  * qexpr -> list
  * '(a b c) -> (a b c)
  */
-lval* lval_qexpr_pop(lval* q) {
+lval* lval_qexpr_unquote(lval* q) {
   assert(q->value.qexpr != NULL);
-  lval* v = q->value.qexpr;
-  q->value.qexpr = NULL;
-  return v;
+  return q->value.qexpr;
 }
 
 
@@ -239,113 +318,236 @@ lval * lval_sexpr_quote(lval* x) {
 
 /* Append sub lval to qexpr */
 lval* lval_qexpr_add(lval* q, lval* x) {
+  lgc_write_barrier(q, x);
   q->value.qexpr = x;
   return q;
 }
 
-/* Print an List type lval */
-void lval_list_print(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    
-    /* Print Value contained within */
-    lval_print(v->value.cell[i]);
-    
-    /* Don't print trailing space if last element */
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
-}
+/* Print v, opening its outermost list with open and closing it with close
+ * Nested lists are printed from an explicit stack rather than by
+ * recursion, so deeply nested data does not exhaust the C stack.
+ */
+static void lval_print_value(lval* v, char open, char close) {
+  static lval** lists = NULL;
+  static int* next = NULL;
+  static char* closes = NULL;
+  static int capacity = 0;
+  int n = 0;
+
+  for (;;) {
+    /* Print v, or open it and push it when it is a list */
+    switch (lval_type(v)) {
+      case LVAL_NUM:   printf("%li", lval_num_value(v)); break;
+
+      /* In the case the type is an error */
+      case LVAL_ERR:
+        printf("Error: ");
+        lval_print_err(v);
+        break;
 
-/* Print an Qexpr type lval */
-void lval_qexpr_print(lval* q) {
+      case LVAL_SYM:   printf("%s", v->value.sym); break;
+      case LVAL_REF:   printf("%s", v->value.ref.sym->value.sym); break;
+      case LVAL_FUN:   printf("<funtion>"); break;
+
+      /* Qexprs are their quoted value with a prefix */
+      case LVAL_QEXPR:
+        assert(v->value.qexpr != NULL);
+        putchar('\'');
+        v = v->value.qexpr;
+        continue;
+
+      case LVAL_LIST:
+        if (n == capacity) {
+          capacity = capacity ? capacity * 2 : 64;
+          lists = realloc(lists, sizeof(lval*) * capacity);
+          next = realloc(next, sizeof(int) * capacity);
+          closes = realloc(closes, capacity);
+        }
+        putchar(n == 0 ? open : '(');
+        lists[n] = v;
+        next[n] = 0;
+        closes[n] = n == 0 ? close : ')';
+        n++;
+        break;
+    }
 
-  assert(q->value.qexpr != NULL);
+    /* Close the lists that are done, then go on with the next element */
+    while (n > 0 && next[n-1] == lists[n-1]->count) {
+      n--;
+      putchar(closes[n]);
+    }
+    if (n == 0) { return; }
 
-  printf("'");
-  lval_print(q->value.qexpr);
+    /* Don't print a space before the first element */
+    if (next[n-1] != 0) { putchar(' '); }
+    v = lists[n-1]->value.cell[next[n-1]++];
+  }
 }
 
-void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_NUM:   printf("%li", v->value.num); break;
-
-    /* In the case the type is an error */
-    case LVAL_ERR:
-      /* Check what type of error it is and print it */
-        printf("Error: %s", v->value.err.msg);
-        break;
- 
-    case LVAL_SYM:   printf("%s", v->value.sym); break;
-    case LVAL_LIST:  lval_list_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_qexpr_print(v); break;
-    case LVAL_FUN:   printf("<funtion>"); break;
-  }
+/* Print an List type lval */
+void lval_list_print(lval* v, char open, char close) {
+  lval_print_value(v, open, close);
 }
 
+void lval_print(lval* v) { lval_print_value(v, '(', ')'); }
+
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
 
+int lenv_version = 0;
+int lenv_const_version = 0;
+
 /* Create a new env */
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
   e->count = 0;
+  e->removed = 0;
+  e->vars_capacity = 0;
   e->vars  = NULL;
+  e->capacity = 0;
+  e->index = NULL;
+  e->frame = NULL;
+  lgc_add_env(e);
   return e;
 }
 
-/* Delete a env */
+/* Delete a env, its values are left to the collector */
 void lenv_del(lenv* e) {
-  for (int i = 0; i<e->count; i++) {
-    free(e->vars[i].sym);
-    lval_del(e->vars[i].val);
-  }
+  lgc_remove_env(e);
+  lenv_version++;
+  lenv_const_version++;
   free(e->vars);
+  free(e->index);
   free(e);
 }
 
+/* Home slot of symbol k in the index of e */
+static int lenv_slot(lenv* e, lval* k) {
+  /* Symbols are interned, so their address is their identity */
+  uintptr_t h = (uintptr_t)k >> 4;
+  h *= (uintptr_t)0x9E3779B97F4A7C15ULL;
+  return (int)((h >> 16) & (e->capacity - 1));
+}
+
+/* Slot of the index of e holding k, or the empty slot where it goes */
+static int lenv_find(lenv* e, lval* k) {
+  int i = lenv_slot(e, k);
+  while (e->index[i] && e->vars[e->index[i]-1].sym != k) {
+    i = (i + 1) & (e->capacity - 1);
+  }
+  return i;
+}
+
+/* Rebuild the index of e with capacity slots, dropping holes from vars */
+static void lenv_rehash(lenv* e, int capacity) {
+  free(e->index);
+  e->index = calloc(capacity, sizeof(int));
+  e->capacity = capacity;
+
+  int n = 0;
+  for (int i = 0; i < e->count; i++) {
+    if (e->vars[i].sym == NULL) { continue; }
+    e->vars[n] = e->vars[i];
+    e->index[lenv_find(e, e->vars[n].sym)] = n + 1;
+    n++;
+  }
+  e->count = n;
+  e->removed = 0;
+}
+
+/* Position of the binding of k in e->vars, -1 if there is none */
+int lenv_index(lenv* e, lval* k) {
+  if (e->capacity == 0) { return -1; }
+  return e->index[lenv_find(e, k)] - 1;
+}
+
 /* Get a val by its symbol name from lenv */
 lval* lenv_get(lenv* e, lval* k) {
 
-  /* Iterate over all items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /* Check if the stored string matches the symbol string */
-    /* If it does, return a copy of the value */
-    if (strcmp(e->vars[i].sym, k->value.sym) == 0) {
-      return lval_copy(e->vars[i].val);
-    }
+  /* Symbols bound by a local frame are found there first */
+  if (e->frame && (k->flags & LVAL_F_LOCAL)) {
+    lval** x = lframe_find(e, k);
+    if (x) { return *x; }
   }
+
+  /* Look the symbol up in the index */
+  /* If it is bound, return the value itself, values are never changed */
+  int i = lenv_index(e, k);
+  if (i >= 0) { return e->vars[i].val; }
+
   /* If no symbol found return error */
-  return lval_err(LERR_ERR, "unbound symbol!");
+  return &lerr_unbound;
 }
 
 /* Replace var in env
  * lenv, lval, lval -> void
  * find k->sym in e; if found, replace it with v,
  *                   if not found, add v to e
+ * The environment never points into the nursery, values are promoted out
+ * of it.
  */
 void lenv_put(lenv* e, lval* k, lval* v) {
 
-  /* Iterate over all items in environment */
-  /* This is to see if variable already exists */
-  for (int i = 0; i < e->count; i++) {
+  /* Keep the index at most half full */
+  if (2 * (e->count + 1) > e->capacity) {
+    lenv_rehash(e, e->capacity ? e->capacity * 2 : 16);
+  }
 
-    /* If variable is found delete item at that position */
-    /* And replace with variable supplied by user */
-    if (strcmp(e->vars[i].sym, k->value.sym) == 0) {
-      lval_del(e->vars[i].val);
-      e->vars[i].val = lval_copy(v);
-      return;
-    }
+  /* If variable is found replace item at that position */
+  /* with variable supplied by user */
+  int slot = lenv_find(e, k);
+  if (e->index[slot]) {
+    lvar* var = &e->vars[e->index[slot]-1];
+    var->val = lval_promote(v);
+    if (!var->redefined) { lenv_const_version++; }
+    var->redefined = 1;
+    lenv_version++;
+    return;
   }
 
-  /* If no existing entry found allocate space for new entry */
+  /* If no existing entry found append a new one */
+  if (e->count == e->vars_capacity) {
+    e->vars_capacity = e->vars_capacity ? e->vars_capacity * 2 : 16;
+    e->vars = realloc(e->vars, sizeof(lvar) * e->vars_capacity);
+  }
+  e->vars[e->count].sym = k;
+  e->vars[e->count].val = lval_promote(v);
+  e->vars[e->count].redefined = 0;
   e->count++;
-  e->vars = realloc(e->vars, sizeof(lvar) * e->count);
+  e->index[slot] = e->count;
+}
+
+/* Remove the binding of k from e, return 0 if there is none
+ * The index is left without tombstones: the entries following the freed
+ * slot in its probe run are shifted back into it when that shortens their
+ * probe.
+ */
+int lenv_remove(lenv* e, lval* k) {
+  if (e->capacity == 0) { return 0; }
+
+  int i = lenv_find(e, k);
+  if (e->index[i] == 0) { return 0; }
+
+  lvar* var = &e->vars[e->index[i]-1];
+  var->sym = NULL;
+  var->val = NULL;
+  e->index[i] = 0;
+  e->removed++;
+  lenv_version++;
+  lenv_const_version++;
+
+  int mask = e->capacity - 1;
+  for (int j = (i + 1) & mask; e->index[j]; j = (j + 1) & mask) {
+    int home = lenv_slot(e, e->vars[e->index[j]-1].sym);
+    /* Move j back to i unless its home lies cyclically in (i, j] */
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      e->index[i] = e->index[j];
+      e->index[j] = 0;
+      i = j;
+    }
+  }
 
-  /* Copy contents of lval and symbol string into new location */
-  e->vars[e->count-1].val = lval_copy(v);
-  e->vars[e->count-1].sym = strdup(k->value.sym);
+  /* Drop the holes once they are most of vars */
+  if (2 * e->removed > e->count) { lenv_rehash(e, e->capacity); }
+  return 1;
 }
@@ -1,51 +1,153 @@
 #if !defined(__LVAL_H__)
 #define __LVAL_H__
 
+#include <stdint.h>
+#include <limits.h>
+
 /* Create Enumeration of Possible Error Types */
 enum { LERR_ERR, LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM, LERR_BAD_LIST };
 
 struct lval;
 struct lenv;
+struct lframe;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lframe lframe;
 
 /* Create Enumeration of Possible lval Types */
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, 
-       LVAL_FUN, LVAL_LIST, LVAL_QEXPR};
-
-typedef lval* (*lbuiltin) (lenv*, lval*);
+       LVAL_FUN, LVAL_LIST, LVAL_QEXPR, LVAL_REF};
+
+/* lval flags */
+enum {
+  LVAL_F_ARENA = 1,       /* allocated in an arena (the nursery) */
+  LVAL_F_REMEMBERED = 2,  /* old value in the remembered set */
+  LVAL_F_FORWARDED = 4,   /* young value already copied, see lgc.c */
+  LVAL_F_COMPILED = 8,    /* list with cached bytecode, see lvm.c */
+  LVAL_F_PURE = 16,       /* builtin without side effects, see lfold.h */
+  LVAL_F_NODE = 7 << 5,   /* node kind of a list, see evaluation.c */
+  LVAL_F_LOCAL = 256      /* symbol some local frame binds, see lresolve.h */
+};
 
+#define LVAL_F_NODE_SHIFT 5
+
+/* Flags describing a value rather than where it lives, kept by copies */
+#define LVAL_F_KEPT (LVAL_F_PURE | LVAL_F_NODE)
+
+/* Builtin functions
+ * A builtin is called with its arguments as a span of argc values that it
+ * borrows from the evaluator's stack: argv must not be kept or changed,
+ * and is only valid until the builtin evaluates anything. argv[-1] holds
+ * the function being called.
+ * Builtins written against the older convention, taking their arguments
+ * as a new list, are wrapped with lval_fun_list.
+ */
+typedef lval* (*lbuiltin) (lenv*, int argc, lval** argv);
+typedef lval* (*lbuiltin_list) (lenv*, lval*);
+
+typedef struct lfun {
+  lbuiltin call;
+  lbuiltin_list list;   /* wrapped by call, see lval_fun_list */
+} lfun;
+
+/* Errors keep the format of their message and the values it formats,
+ * the message is only made when they are printed (see lval_err)
+ */
 typedef struct lerr {
-  int code;
-  char* msg;
+  const char* fmt;      /* message format, a string literal */
+  struct lval* args;    /* list of the values of its conversions, or NULL */
 } lerr;
 
+/* Resolved symbol in code, see lresolve.h */
+typedef struct lref {
+  struct lval* sym;     /* interned symbol */
+  int depth;            /* frames up from the innermost, -1 for a global */
+  int slot;             /* slot in that frame, for a global the position
+                           of its binding when last looked up (a cache) */
+} lref;
+
 /* Declare New lval Struct */
 struct lval {
   int type;
+  int flags;
   union {
     long num;           /* type == LVAL_NUM */
-    lerr err;           /* type == LVAL_ERR */
+    lerr err;           /* type == LVAL_ERR, its code in count */
     char* sym;          /* type == LVAL_SYM */
-    lbuiltin fun;       /* type == LVAL_FUN */
+    lfun fun;           /* type == LVAL_FUN */
     struct lval* qexpr; /* type == LVAL_QEXPR */
     struct lval** cell; /* type == LVAL_LIST */
+    lref ref;           /* type == LVAL_REF */
   } value;
   /* Count and Pointer to a list of "lval*"; */
-  int count;
+  int count;            /* for an error, its LERR code, for a symbol
+                           the frames binding it (see lresolve.h) */
+  int mark;             /* collector epoch, see lgc.c */
 };
 
 
-/* Create a new number type lval */
+
+/* Immediate numbers
+ * Small integers are not allocated: they are stored shifted left by one
+ * bit directly in the "lval*" with the low bit set. Real lval structs are
+ * always at least 2-byte aligned, so the low bit tells them apart.
+ * Numbers that do not fit in the remaining bits are boxed as before.
+ */
+#define LVAL_FIXNUM_TAG 1
+#define LVAL_FIXNUM_MAX ((long)(INTPTR_MAX >> 1))
+#define LVAL_FIXNUM_MIN ((long)(INTPTR_MIN >> 1))
+
+/* Check whether v is an immediate number */
+static inline int lval_is_fixnum(const lval* v) {
+  return ((uintptr_t)v & LVAL_FIXNUM_TAG) != 0;
+}
+
+/* Encode x as an immediate number, x must be in fixnum range */
+static inline lval* lval_fixnum(long x) {
+  return (lval*)(((uintptr_t)(intptr_t)x << 1) | LVAL_FIXNUM_TAG);
+}
+
+/* Type of v, immediate numbers included */
+static inline int lval_type(const lval* v) {
+  return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+/* Value of a number type lval, immediate or boxed */
+static inline long lval_num_value(const lval* v) {
+  return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->value.num;
+}
+
+/* Truth
+ * The number 0 and the empty list, evaluated or quoted, are false.
+ * Every other value is true.
+ */
+static inline int lval_is_false(const lval* v) {
+  if (lval_is_fixnum(v)) { return v == (const lval*)(uintptr_t)LVAL_FIXNUM_TAG; }
+  if (v->type == LVAL_QEXPR) { v = v->value.qexpr; }
+  return lval_type(v) == LVAL_LIST && v->count == 0;
+}
+
+/* Create a new number type lval, immediate when it fits */
 lval* lval_num(long x);
 
 /* Get type name */
 char* ltype_name(int t);
  
-/* Create a new error type lval */
+/* Create a new error type lval
+ * fmt must outlive the error. Its conversions are %i, %li and %s, and
+ * %s arguments must outlive it too: literals, type names or the names of
+ * interned symbols, they are kept as pointers and never copied.
+ */
 lval* lval_err(int code, char* fmt, ...);
 
-/* Create a pointer to a new Symbol lval */
+/* Preallocated errors
+ * The errors evaluation runs into most, made once outside the collected
+ * heap and shared by every failure: raising them allocates nothing.
+ */
+extern lval lerr_unbound;       /* unbound symbol */
+extern lval lerr_not_function;  /* list not starting with a function */
+
+/* Get the Symbol lval named s, symbols are interned (see lsym.h) */
 lval* lval_sym(char* s);
 
 /* A pointer to a new empty list lval */
@@ -57,30 +159,33 @@ lval* lval_qexpr(void);
 /* Create a pointer to a new Function lval */
 lval* lval_fun(lbuiltin func);
 
-/* Free var of lval type */
-void lval_del(lval* v);
+/* Create a Function lval calling func with its arguments as a list */
+lval* lval_fun_list(lbuiltin_list func);
 
-/* Copy a lval to new lval */
-lval* lval_copy(lval* v);
+/* Create a reference to symbol k at (depth, slot), see lresolve.h */
+lval* lval_ref(lval* k, int depth, int slot);
 
-/* Add x to sub element of list v */
+/* Values are never changed once built, so they are shared freely and
+ * reclaimed by the collector (see lgc.h) instead of being deleted. */
+
+/* Copy v out of the nursery, sharing what is not in it */
+lval* lval_promote(lval* v);
+
+/* Add x to sub element of list v, v must still be under construction */
 lval* lval_list_add(lval* v, lval* x);
 
-/* Pop up i-th sub element of list v */
-lval* lval_list_pop(lval* v, int i);
+/* New list of the n values of cells */
+lval* lval_list_from(int n, lval** cells);
 
-/*Take i-th sub element and delete list v */
-lval* lval_list_take(lval* v, int i);
+/* New list of the sub elements of v from the i-th on */
+lval* lval_list_tail(lval* v, int i);
 
-/* John two list */
+/* John two list into a new one */
 lval* lval_list_join(lval* x, lval* y);
 
-/* Take sub element from qexpr, delete qexpr */
+/* Take sub element from qexpr */
 lval* lval_qexpr_unquote(lval* q);
 
-/* Pop sub element from qexpr */
-lval* lval_qexpr_pop(lval* q);
-
 /* Quote s-expr */
 lval* lval_sexpr_quote(lval* x);
 
@@ -100,18 +205,46 @@ void lval_list_print(lval* v, char open, char close);
 /* environment */
 
 typedef struct lvar {
-  char* sym;
+  lval* sym;            /* interned symbol, NULL once removed */
   lval* val;
+  int redefined;        /* val was replaced since the binding was made */
 } lvar;
 
+/* Binding version, bumped whenever a binding is replaced or removed or
+ * an environment deleted, in any environment. Caches of looked up values
+ * are valid while it does not change.
+ */
+extern int lenv_version;
+
+/* Constant binding version, only bumped when a binding never redefined
+ * before is replaced or removed, or an environment deleted. Values
+ * derived from such bindings are valid while it does not change.
+ */
+extern int lenv_const_version;
+
+/* Bindings are kept in vars in insertion order, removed ones leave a
+ * hole until the next compaction. index is an open-addressing hash table
+ * with linear probing from symbols to their position in vars. Its
+ * capacity is a power of two and it is kept at most half full. */
 struct lenv {
-  int count;
+  int count;            /* entries in vars, holes included */
+  int removed;          /* holes in vars */
+  int vars_capacity;
   lvar* vars;
+  int capacity;         /* slots in index */
+  int* index;           /* position in vars + 1, 0 for an empty slot */
+  lframe* frame;        /* innermost local frame, NULL at top level */
 };
 
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
+
+/* Position of the binding of k in e->vars, -1 if there is none */
+int lenv_index(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
+
+/* Remove the binding of k from e, return 0 if there is none */
+int lenv_remove(lenv* e, lval* k);
  
 #endif
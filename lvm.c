@@ -0,0 +1,1246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lvm.h"
+#include "lgc.h"
+#include "lalloc.h"
+#include "lresolve.h"
+#include "lfold.h"
+#include "lform.h"
+#include "ljit.h"
+
+/* Evaluate v, or evaluate it by walking it, see evaluation.c */
+extern lval* lval_eval(lenv* e, lval* v);
+extern lval* lval_eval_tree(lenv* e, lval* v);
+extern lval* lval_eval_tree_step(lenv* e, lval* v);
+
+/* Builtin with a fast path in the VM, see evaluation.c */
+extern lval* builtin_add(lenv* e, int argc, lval** argv);
+
+int lvm_engine = LVM_ENGINE_DEFAULT;
+
+#define LOP_NAME(name, n) #name,
+#define LOP_OPERANDS(name, n) n,
+
+static const char* lop_names[LOP_COUNT] = { LOP_LIST(LOP_NAME) };
+
+/* Operands taken by each opcode */
+static const int lop_operands[LOP_COUNT] = { LOP_LIST(LOP_OPERANDS) };
+
+/* Dispatch
+ * With GCC labels as values the code is direct-threaded: once compiled,
+ * each opcode is replaced by the address of the code running it, and
+ * each instruction jumps straight to the next one. Otherwise, or when
+ * built with -DLVM_SWITCH, a portable switch in a loop is used.
+ */
+#if defined(__GNUC__) && !defined(LVM_SWITCH)
+#define LVM_THREADED
+#endif
+
+static lval* lvm_exec(lenv* e, lcode* c);
+
+#if defined(LVM_THREADED)
+/* Address of the code running each opcode, set by lvm_exec */
+static void** lvm_labels = NULL;
+#endif
+
+/* Opcode of the instruction word w */
+static int lop_decode(lword w) {
+#if defined(LVM_THREADED)
+  for (int op = 0; op < LOP_COUNT; op++) {
+    if ((lword)lvm_labels[op] == w) { return op; }
+  }
+#endif
+  return (int)w;
+}
+
+
+/* Compiler */
+
+/* Append w to c, return its offset */
+static int lcode_emit(lcode* c, lword w) {
+  if (c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(lword) * c->capacity);
+  }
+  c->ops[c->count] = w;
+  return c->count++;
+}
+
+/* Add x to the constants of c, return its index */
+static int lcode_const(lcode* c, lval* x) {
+  c->consts = lval_list_add(c->consts, x);
+  return c->consts->count - 1;
+}
+
+/* Append a call with n arguments to c, with level calls pending
+ * When the last argument was just pushed by a CONST or a GLOBAL, both are
+ * fused into a single superinstruction.
+ */
+static void lcode_call(lcode* c, int n, int level) {
+  if (n > 0 && c->last >= 0 && c->last == c->count - 2) {
+    lword op = c->ops[c->last];
+    if (op == LOP_CONST || op == LOP_GLOBAL) {
+      c->ops[c->last] = op == LOP_CONST ? LOP_CONST_CALL : LOP_GLOBAL_CALL;
+      lcode_emit(c, n);
+      lcode_emit(c, level);
+      c->last = -1;
+      return;
+    }
+  }
+  c->last = lcode_emit(c, LOP_CALL);
+  lcode_emit(c, n);
+  lcode_emit(c, level);
+}
+
+/* Lists whose call or special form is being compiled, innermost last */
+typedef struct lcode_frame {
+  lval* v;
+  int next;             /* next element to compile */
+  int depth;            /* values on the stack below the list */
+  int form;             /* kind of special form, see lform.h, or 0 */
+  int tail;             /* the list is in tail position */
+  int sub;              /* step in the cond clause at next */
+  int skip;             /* jumps past the branch being compiled */
+  int end;              /* jumps to the end of the form */
+  int top;              /* offset a loop jumps back to */
+  int level;            /* calls pending while its elements are evaluated */
+  int region;           /* operand of the DEPTH starting the operand being
+                           compiled, or -1 */
+  int reach;            /* calls pending at most in that operand */
+  int outer;            /* frame whose operand held that DEPTH, or -1 */
+  lval* var;            /* symbol a loop binds while its bodies are
+                           compiled, or NULL */
+} lcode_frame;
+
+static lcode_frame* lcode_frames = NULL;
+static int lcode_frames_capacity = 0;
+
+/* Frame whose operand is the innermost one started by a DEPTH, or -1 */
+static int lcode_region = -1;
+
+/* Compile v, which leaves depth + 1 values on the stack
+ * A call or a special form is only started here: the frame pushed at fp
+ * compiles its elements then the call itself, see lcode_expr. level is
+ * the number of calls pending as v is evaluated, counted as in the tree
+ * walker. callee is set when v is the function of a call, tail when v is
+ * in tail position.
+ */
+static void lcode_value(lcode* c, lval* v, int depth, int level, int* fp,
+                        int callee, int tail) {
+  if (depth + 1 > c->max_stack) { c->max_stack = depth + 1; }
+
+  /* Single element lists, as in the tree walker */
+  while (lval_type(v) == LVAL_LIST && v->count == 1) { v = v->value.cell[0]; }
+
+  /* Symbols the loops being compiled bind are found in their frames */
+  int t = lval_type(v);
+  for (int i = *fp - 1, d = 0; t == LVAL_SYM && i >= 0; i--) {
+    if (lcode_frames[i].var == NULL) { continue; }
+    if (lcode_frames[i].var == v) {
+      c->last = lcode_emit(c, LOP_LOCAL);
+      lcode_emit(c, d);
+      lcode_emit(c, 0);
+      return;
+    }
+    d++;
+  }
+
+  /* Functions are looked up through an inline cache */
+  if (callee && (t == LVAL_SYM || (t == LVAL_REF && v->value.ref.depth < 0))) {
+    c->last = lcode_emit(c, LOP_CALLEE);
+    lcode_emit(c, lcode_const(c, v));
+    lcode_emit(c, -1);
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+    return;
+  }
+
+  switch (t) {
+    case LVAL_SYM:
+      c->last = lcode_emit(c, LOP_SYM);
+      lcode_emit(c, lcode_const(c, v));
+      return;
+
+    case LVAL_REF:
+      if (v->value.ref.depth >= 0) {
+        c->last = lcode_emit(c, LOP_LOCAL);
+        lcode_emit(c, v->value.ref.depth);
+        lcode_emit(c, v->value.ref.slot);
+      } else {
+        c->last = lcode_emit(c, LOP_GLOBAL);
+        lcode_emit(c, lcode_const(c, v));
+      }
+      return;
+
+    case LVAL_LIST: {
+      /* Empty lists evaluate to themselves, malformed forms fail */
+      if (v->count == 0) { break; }
+      int form = lform_kind(v);
+      lval* err = form ? lform_check(v, form) : NULL;
+      if (err) {
+        lcode_emit(c, LOP_FAIL);
+        lcode_emit(c, lcode_const(c, err));
+        c->last = -1;
+        return;
+      }
+
+      if (*fp == lcode_frames_capacity) {
+        lcode_frames_capacity = lcode_frames_capacity ?
+          lcode_frames_capacity * 2 : 64;
+        lcode_frames = realloc(lcode_frames,
+                               sizeof(lcode_frame) * lcode_frames_capacity);
+      }
+      lcode_frame* f = &lcode_frames[*fp];
+      f->v = v;
+      f->next = 0;
+      f->depth = depth;
+      f->form = form;
+      f->tail = tail;
+      f->sub = 0;
+      f->skip = -1;
+      f->end = -1;
+      f->level = level + 1;
+      f->region = -1;
+      f->var = NULL;
+      (*fp)++;
+
+      /* Charged by the DEPTH starting the operand, or as the run starts */
+      int* reach = lcode_region < 0 ?
+        &c->depth : &lcode_frames[lcode_region].reach;
+      if (f->level > *reach) { *reach = f->level; }
+      return;
+    }
+  }
+
+  /* Everything else evaluates to itself */
+  c->last = lcode_emit(c, LOP_CONST);
+  lcode_emit(c, lcode_const(c, v));
+}
+
+/* Special forms
+ * Jumps whose target is not known yet are chained through their operand,
+ * each holding the offset of the previous one in the chain, or -1.
+ */
+
+/* Emit an operand of a jump, added to the chain at *chain */
+static void lcode_link(lcode* c, int* chain) {
+  *chain = lcode_emit(c, *chain);
+}
+
+/* Make the jumps chained at *chain reach the next instruction */
+static void lcode_land(lcode* c, int* chain) {
+  for (int at = *chain; at >= 0; ) {
+    int prev = (int)c->ops[at];
+    c->ops[at] = c->count;
+    at = prev;
+  }
+  *chain = -1;
+
+  /* Nothing is fused across a jump target */
+  c->last = -1;
+}
+
+/* Push (), the value of a form without one */
+static void lcode_nil(lcode* c, int depth) {
+  if (depth + 1 > c->max_stack) { c->max_stack = depth + 1; }
+  c->last = lcode_emit(c, LOP_CONST);
+  lcode_emit(c, lcode_const(c, lval_list()));
+}
+
+/* Leave form f with the value of the branch just compiled */
+static void lcode_leave(lcode* c, lcode_frame* f) {
+  if (f->tail) {
+    lcode_emit(c, LOP_RETURN);
+    return;
+  }
+  lcode_emit(c, LOP_JUMP);
+  lcode_link(c, &f->end);
+}
+
+/* Test the value just compiled for form f, skipping the branch that
+ * follows when it is false
+ */
+static void lcode_branch(lcode* c, lcode_frame* f) {
+  lcode_emit(c, LOP_BRANCH);
+  lcode_link(c, &f->skip);
+}
+
+/* Continue the special form of the innermost frame
+ * Each step emits what follows the operand compiled last, then starts
+ * the next one at the depth of the form, or ends the form: the value of
+ * an operand is consumed before the next one is pushed.
+ *
+ * Only the first operand of a form always runs. Any other one starting a
+ * call is preceded by a DEPTH, charging the calls left pending in it
+ * when it does run, rather than as the run starts.
+ */
+static void lcode_form_next(lcode* c, int* fp) {
+  lcode_frame* f = &lcode_frames[*fp - 1];
+  lval** x = f->v->value.cell;
+  int n = f->v->count;
+  int i = f->next++;
+  lval* next = NULL;
+  int value = 0;
+
+  if (f->region >= 0) {
+    c->ops[f->region] = f->reach;
+    f->region = -1;
+    lcode_region = f->outer;
+  }
+
+  switch (f->form) {
+    case LFORM_IF:
+      if (i == 0) {
+        next = x[1];
+      } else if (i == 1) {
+        lcode_branch(c, f);
+        next = x[2];
+        value = 1;
+      } else if (i == 2) {
+        lcode_leave(c, f);
+        lcode_land(c, &f->skip);
+        if (n == 4) {
+          next = x[3];
+          value = 1;
+        } else {
+          lcode_nil(c, f->depth);
+        }
+      }
+      break;
+
+    case LFORM_WHEN:
+      if (i == 0) {
+        next = x[1];
+        break;
+      }
+      if (i == 1) { lcode_branch(c, f); }
+      if (i + 1 < n) {
+        if (i > 1) { lcode_emit(c, LOP_DROP); }
+        next = x[i + 1];
+        value = i + 1 == n - 1;
+        break;
+      }
+      if (n == 2) { lcode_nil(c, f->depth); }
+      lcode_leave(c, f);
+      lcode_land(c, &f->skip);
+      lcode_nil(c, f->depth);
+      break;
+
+    case LFORM_AND:
+    case LFORM_OR:
+      if (i + 1 < n) {
+        if (i > 0) {
+          lcode_emit(c, f->form == LFORM_AND ? LOP_AND : LOP_OR);
+          lcode_link(c, &f->end);
+        }
+        next = x[i + 1];
+        value = i + 1 == n - 1;
+      }
+      break;
+
+    case LFORM_COND:
+      /* next is the clause, sub the steps done in it */
+      f->next = i ? i : 1;
+      while (next == NULL && f->next < n) {
+        lval* cl = x[f->next];
+        int m = cl->count;
+        int step = f->sub++;
+        if (step == 0) {
+          next = cl->value.cell[0];
+        } else if (step == 1 && m == 1) {
+          /* A clause without bodies has the value of its test */
+          lcode_emit(c, LOP_OR);
+          lcode_link(c, &f->end);
+          f->next++;
+          f->sub = 0;
+        } else if (step < m) {
+          if (step == 1) { lcode_branch(c, f); }
+          else { lcode_emit(c, LOP_DROP); }
+          next = cl->value.cell[step];
+          value = step == m - 1;
+        } else {
+          lcode_leave(c, f);
+          lcode_land(c, &f->skip);
+          f->next++;
+          f->sub = 0;
+        }
+      }
+      if (next == NULL) { lcode_nil(c, f->depth); }
+      break;
+
+    case LFORM_WHILE:
+      if (i == 0) {
+        f->top = c->count;
+        c->last = -1;
+        next = x[1];
+        break;
+      }
+      if (i == 1) { lcode_branch(c, f); }
+      else { lcode_emit(c, LOP_DROP); }
+      if (i + 1 < n) {
+        next = x[i + 1];
+        break;
+      }
+      lcode_emit(c, LOP_LOOP);
+      lcode_emit(c, f->top);
+      lcode_land(c, &f->skip);
+      lcode_nil(c, f->depth);
+      break;
+
+    case LFORM_DOTIMES:
+    case LFORM_FOREACH: {
+      int dotimes = f->form == LFORM_DOTIMES;
+      if (i == 0) {
+        next = x[1]->value.cell[1];
+        break;
+      }
+      if (i == 1) {
+        f->var = lform_var(f->v);
+        lcode_emit(c, dotimes ? LOP_DOTIMES : LOP_FOREACH);
+        lcode_emit(c, lcode_const(c, f->var));
+        lcode_link(c, &f->end);
+        f->top = c->count;
+        c->last = -1;
+      } else {
+        lcode_emit(c, LOP_DROP);
+      }
+      if (i + 1 < n) {
+        next = x[i + 1];
+        break;
+      }
+      lcode_emit(c, dotimes ? LOP_STEP : LOP_EACH);
+      lcode_emit(c, f->top);
+      lcode_nil(c, f->depth);
+      lcode_emit(c, LOP_LEAVE);
+      f->var = NULL;
+      break;
+    }
+  }
+
+  if (next) {
+    /* As in the tree walker, the form is done once its value is started */
+    int level = value ? f->level - 1 : f->level;
+    if (i > 0 && lval_type(next) == LVAL_LIST && next->count > 0) {
+      lcode_emit(c, LOP_DEPTH);
+      f->region = lcode_emit(c, 0);
+      f->reach = 0;
+      f->outer = lcode_region;
+      lcode_region = *fp - 1;
+      c->last = -1;
+    }
+    lcode_value(c, next, f->depth, level, fp, 0, f->tail && value);
+    return;
+  }
+
+  /* The value of the form is on the stack, at its end */
+  lcode_land(c, &f->end);
+  (*fp)--;
+}
+
+/* Compile v, which leaves one value on the stack
+ * Nested lists are compiled from an explicit stack of frames rather than
+ * by recursion, so deep code does not exhaust the C stack.
+ */
+static void lcode_expr(lcode* c, lval* v) {
+  int fp = 0;
+  lcode_region = -1;
+  lcode_value(c, v, 0, 0, &fp, 0, 1);
+
+  while (fp > 0) {
+    lcode_frame* f = &lcode_frames[fp - 1];
+    if (f->form) {
+      lcode_form_next(c, &fp);
+    } else if (f->next < f->v->count) {
+      int i = f->next++;
+      lcode_value(c, f->v->value.cell[i], f->depth + i, f->level, &fp,
+                  i == 0, 0);
+    } else {
+      lcode_call(c, f->v->count - 1, f->level);
+      fp--;
+    }
+  }
+}
+
+/* Compile v into c */
+void lcode_compile(lcode* c, lval* v) {
+  c->ops = NULL;
+  c->count = 0;
+  c->capacity = 0;
+  c->consts = lval_list();
+  c->max_stack = 0;
+  c->depth = 0;
+  c->version = -1;
+  c->last = -1;
+  c->runs = 0;
+  c->deopts = 0;
+  c->native = NULL;
+
+  lcode_expr(c, v);
+  lcode_emit(c, LOP_RETURN);
+
+#if defined(LVM_THREADED)
+  /* Replace the opcodes by the address of their code */
+  if (lvm_labels == NULL) { lvm_exec(NULL, NULL); }
+  for (int i = 0; i < c->count; ) {
+    int op = (int)c->ops[i];
+    c->ops[i] = (lword)lvm_labels[op];
+    i += 1 + lop_operands[op];
+  }
+#endif
+}
+
+/* Release what c holds, the constants are left to the collector */
+void lcode_free(lcode* c) {
+  ljit_free(c);
+  free(c->ops);
+  c->ops = NULL;
+  c->consts = NULL;
+}
+
+/* Print the instructions of c */
+void lcode_print(lcode* c) {
+  for (int i = 0; i < c->count; ) {
+    int op = lop_decode(c->ops[i]);
+    /* Only the constant of an inline cache is shown */
+    int shown = op == LOP_CALLEE ? 1 : lop_operands[op];
+    printf("%4i  %s", i, lop_names[op]);
+    if (shown) { printf("%*s", 12 - (int)strlen(lop_names[op]), ""); }
+    for (int j = 1; j <= shown; j++) {
+      printf(" %4li", (long)c->ops[i + j]);
+    }
+    if (op == LOP_CONST || op == LOP_SYM || op == LOP_GLOBAL || op == LOP_CALLEE ||
+        op == LOP_CONST_CALL || op == LOP_GLOBAL_CALL || op == LOP_FAIL ||
+        op == LOP_DOTIMES || op == LOP_FOREACH) {
+      printf("    ; ");
+      lval_print(c->consts->value.cell[c->ops[i + 1]]);
+    }
+    putchar('\n');
+    i += 1 + lop_operands[op];
+  }
+}
+
+
+/* Virtual machine */
+
+/* Value stack, shared by nested runs */
+static lval** lvm_stack = NULL;
+static int lvm_sp = 0;
+static int lvm_capacity = 0;
+
+static lvm_stats lvm_stat;
+
+/* Make room for n more values on the stack */
+static void lvm_reserve(int n) {
+  if (lvm_stack == NULL) { lgc_add_range(&lvm_stack, &lvm_sp); }
+  if (lvm_sp + n <= lvm_capacity) { return; }
+
+  while (lvm_sp + n > lvm_capacity) {
+    lvm_capacity = lvm_capacity ? lvm_capacity * 2 : 256;
+  }
+  lvm_stack = realloc(lvm_stack, sizeof(lval*) * lvm_capacity);
+  if (lvm_stack == NULL) {
+    perror("lispy: out of memory");
+    exit(1);
+  }
+}
+
+/* Call the function below the n values on top of the stack with them,
+ * replacing all of them with the result, and return it
+ * A tail evaluation returned by the function is left to the trampoline
+ * if the call is in tail position, and done right away otherwise, with
+ * the calls pending outside of the call, level of them in the run, as in
+ * the tree walker. Values on the stack are never errors, only the
+ * function needs checking.
+ */
+static lval* lvm_call(lenv* e, int n, int level, int tail) {
+  lgc_safepoint();
+
+  /* The stack is read again, the collector may have moved values */
+  lval** args = &lvm_stack[lvm_sp - n];
+  lval* f = args[-1];
+  lval* r = &lerr_not_function;
+
+  /* The arguments are passed in place, they stay on the stack */
+  if (lval_type(f) == LVAL_FUN) { r = f->value.fun.call(e, n, args); }
+  lvm_sp -= n;
+
+  if (r == LVM_TAIL && !tail) {
+    lenv* te;
+    lval* v = lvm_take_tail(&te);
+    int depth = lvm_depth;
+    lvm_depth = lvm_depth_base + level - 1;
+    r = lval_eval(te, v);
+    lvm_depth = depth;
+  }
+  lvm_stack[lvm_sp - 1] = r;
+  return r;
+}
+
+/* Add the two values on top of the stack in place if they are fixnums
+ * and the function below them is builtin_add, return 0 otherwise
+ */
+static int lvm_add_fixnums(void) {
+  lval* f = lvm_stack[lvm_sp - 3];
+  lval* x = lvm_stack[lvm_sp - 2];
+  lval* y = lvm_stack[lvm_sp - 1];
+  if (!lval_is_fixnum(x) || !lval_is_fixnum(y)) { return 0; }
+  if (lval_type(f) != LVAL_FUN || f->value.fun.call != builtin_add) { return 0; }
+
+  /* Fixnums have a spare bit, so their sum cannot overflow a long */
+  long z = lval_num_value(x) + lval_num_value(y);
+  if (z < LVAL_FIXNUM_MIN || z > LVAL_FIXNUM_MAX) { return 0; }
+  lvm_sp -= 2;
+  lvm_stack[lvm_sp - 1] = lval_fixnum(z);
+  return 1;
+}
+
+/* Fill the inline cache of the CALLEE instruction whose operands are at
+ * ip, with the value of its constant in e
+ * Unbound functions are not cached, the error is left in it for the
+ * instruction to return.
+ */
+static void lvm_callee(lenv* e, lval** consts, lword* ip) {
+  lval* k = consts[ip[0]];
+  lval* f;
+  lvm_stat.callee_misses++;
+  if (lval_type(k) == LVAL_REF) {
+    f = lenv_get_ref(e, k);
+  } else {
+    f = lenv_get(e, k);
+  }
+  /* A symbol a frame may bind is looked up each time */
+  lval* sym = lval_type(k) == LVAL_REF ? k->value.ref.sym : k;
+  int cached = lval_type(f) != LVAL_ERR && !(sym->flags & LVAL_F_LOCAL);
+  ip[1] = cached ? lenv_version : -1;
+  ip[2] = (lword)e;
+  ip[3] = (lword)f;
+}
+
+/* Make n calls pending in the run, more than are, for DEPTH n
+ * Return the error once that passes the limit, or NULL.
+ */
+static lval* lvm_reach(int n) {
+  if (!lvm_push_depth(lvm_depth_base + n - lvm_depth)) {
+    return lvm_depth_error();
+  }
+  return NULL;
+}
+
+/* What native code calls back into */
+static const ljit_vm lvm_jit = {
+  &lvm_stack, &lvm_sp, lvm_call, lvm_callee, lvm_reach, lop_decode,
+  lop_operands
+};
+
+#if defined(LVM_THREADED)
+#define LVM_AT_RETURN(ip)  (*(ip) == (lword)lvm_labels[LOP_RETURN])
+#define LVM_LABEL(name, n) &&lop_##name,
+#define LVM_BEGIN          LVM_NEXT;
+#define LVM_CASE(name)     lop_##name:
+#define LVM_NEXT           goto *(void*)*ip++
+#define LVM_END
+#else
+#define LVM_AT_RETURN(ip)  (*(ip) == LOP_RETURN)
+#define LVM_BEGIN          for (;;) { switch (*ip++) {
+#define LVM_CASE(name)     case LOP_##name:
+#define LVM_NEXT           break
+#define LVM_END            } }
+#endif
+
+/* Translate c while its bytecode runs, its loops being hot, return 0 if
+ * it cannot be
+ */
+static int lvm_translate(lcode* c) {
+  if (!ljit_enabled || c->deopts >= ltier.max_deopts) { return 0; }
+  if (!ljit_compile(c, &lvm_jit)) { return 0; }
+  lvm_stat.translated++;
+  lvm_stat.looping++;
+  return 1;
+}
+
+/* Count a jump back to ip, the head of a loop, going on in native code
+ * from there once the loops of the run jumped back jit_runs times
+ */
+#define LVM_BACK_EDGE \
+  if (++backs == ltier.jit_runs && lvm_translate(c)) { \
+    lvm_sp = base; \
+    return ljit_resume(e, c, (int)(ip - c->ops)); \
+  }
+
+/* Run c in e
+ * Called with c NULL, only sets lvm_labels. The first error a lookup or
+ * a call gives is returned at once, as is a pending tail evaluation, whose
+ * marker is typed as an error.
+ */
+static lval* lvm_exec(lenv* e, lcode* c) {
+#if defined(LVM_THREADED)
+  static void* labels[LOP_COUNT] = { LOP_LIST(LVM_LABEL) };
+  if (c == NULL) { lvm_labels = labels; return NULL; }
+#endif
+
+  lval** consts = c->consts->value.cell;
+  lword* ip = c->ops;
+  int base = lvm_sp;
+  int backs = 0;
+
+  LVM_BEGIN
+
+  LVM_CASE(CONST)
+    lvm_stack[lvm_sp++] = consts[*ip++];
+    LVM_NEXT;
+
+  LVM_CASE(SYM) {
+    lval* x = lenv_get(e, consts[*ip++]);
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    lvm_stack[lvm_sp++] = x;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(GLOBAL) {
+    lval* x = lenv_get_ref(e, consts[*ip++]);
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    lvm_stack[lvm_sp++] = x;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(LOCAL) {
+    lframe* f = e->frame;
+    for (lword d = ip[0]; d > 0; d--) { f = f->parent; }
+    lvm_stack[lvm_sp++] = f->slots[ip[1]];
+    ip += 2;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(CALLEE)
+    if (ip[1] != lenv_version || (lenv*)ip[2] != e) {
+      lvm_callee(e, consts, ip);
+      if (lval_type((lval*)ip[3]) == LVAL_ERR) { return (lval*)ip[3]; }
+    }
+    lvm_stack[lvm_sp++] = (lval*)ip[3];
+    ip += 4;
+    LVM_NEXT;
+
+  LVM_CASE(CALL) {
+    ip += 2;
+    lval* r = lvm_call(e, (int)ip[-2], (int)ip[-1], LVM_AT_RETURN(ip));
+    if (lval_type(r) == LVAL_ERR) { return r; }
+    consts = c->consts->value.cell;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(CONST_CALL) {
+    lvm_stack[lvm_sp++] = consts[ip[0]];
+    int n = (int)ip[1];
+    ip += 3;
+    if (n == 2 && lvm_add_fixnums()) { LVM_NEXT; }
+    lval* r = lvm_call(e, n, (int)ip[-1], LVM_AT_RETURN(ip));
+    if (lval_type(r) == LVAL_ERR) { return r; }
+    consts = c->consts->value.cell;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(GLOBAL_CALL) {
+    lval* f = lenv_get_ref(e, consts[ip[0]]);
+    if (lval_type(f) == LVAL_ERR) { return f; }
+    lvm_stack[lvm_sp++] = f;
+    int n = (int)ip[1];
+    ip += 3;
+    if (n == 2 && lvm_add_fixnums()) { LVM_NEXT; }
+    lval* r = lvm_call(e, n, (int)ip[-1], LVM_AT_RETURN(ip));
+    if (lval_type(r) == LVAL_ERR) { return r; }
+    consts = c->consts->value.cell;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(RETURN)
+    return lvm_stack[--lvm_sp];
+
+  LVM_CASE(FAIL)
+    return consts[ip[0]];
+
+  LVM_CASE(JUMP)
+    ip = c->ops + ip[0];
+    LVM_NEXT;
+
+  LVM_CASE(BRANCH)
+    ip = lval_is_false(lvm_stack[--lvm_sp]) ? c->ops + ip[0] : ip + 1;
+    LVM_NEXT;
+
+  LVM_CASE(AND)
+    if (lval_is_false(lvm_stack[lvm_sp - 1])) {
+      ip = c->ops + ip[0];
+      LVM_NEXT;
+    }
+    lvm_sp--;
+    ip++;
+    LVM_NEXT;
+
+  LVM_CASE(OR)
+    if (!lval_is_false(lvm_stack[lvm_sp - 1])) {
+      ip = c->ops + ip[0];
+      LVM_NEXT;
+    }
+    lvm_sp--;
+    ip++;
+    LVM_NEXT;
+
+  LVM_CASE(DROP)
+    lvm_sp--;
+    LVM_NEXT;
+
+  LVM_CASE(DOTIMES) {
+    lval* r = lform_enter(e, LFORM_DOTIMES, consts[ip[0]],
+                          lvm_stack[lvm_sp - 1]);
+    if (r) {
+      if (lval_type(r) == LVAL_ERR) { return r; }
+      lvm_stack[lvm_sp - 1] = r;
+      ip = c->ops + ip[1];
+      LVM_NEXT;
+    }
+    lvm_sp--;
+    ip += 2;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(FOREACH) {
+    lval* r = lform_enter(e, LFORM_FOREACH, consts[ip[0]],
+                          lvm_stack[lvm_sp - 1]);
+    if (r) {
+      if (lval_type(r) == LVAL_ERR) { return r; }
+      lvm_stack[lvm_sp - 1] = r;
+      ip = c->ops + ip[1];
+      LVM_NEXT;
+    }
+    lvm_sp--;
+    ip += 2;
+    LVM_NEXT;
+  }
+
+  /* A count below its end is stepped on its tagged value in place */
+  LVM_CASE(STEP) {
+    lval** s = e->frame->slots;
+    if (lval_is_fixnum(s[0]) && lval_is_fixnum(s[1])) {
+      intptr_t i = (intptr_t)s[0] + 2;
+      if (i < (intptr_t)s[1]) {
+        s[0] = (lval*)i;
+        ip = c->ops + ip[0];
+        LVM_BACK_EDGE;
+        LVM_NEXT;
+      }
+      ip++;
+      LVM_NEXT;
+    }
+    if (!lform_step(e, LFORM_DOTIMES)) {
+      ip++;
+      LVM_NEXT;
+    }
+    ip = c->ops + ip[0];
+    LVM_BACK_EDGE;
+    LVM_NEXT;
+  }
+
+  LVM_CASE(EACH)
+    if (!lform_step(e, LFORM_FOREACH)) {
+      ip++;
+      LVM_NEXT;
+    }
+    ip = c->ops + ip[0];
+    LVM_BACK_EDGE;
+    LVM_NEXT;
+
+  LVM_CASE(LOOP)
+    ip = c->ops + ip[0];
+    LVM_BACK_EDGE;
+    LVM_NEXT;
+
+  LVM_CASE(LEAVE)
+    lframe_leave(e);
+    LVM_NEXT;
+
+  LVM_CASE(DEPTH)
+    if (lvm_depth_base + ip[0] > lvm_depth) {
+      lval* err = lvm_reach((int)ip[0]);
+      if (err) { return err; }
+    }
+    ip++;
+    LVM_NEXT;
+
+  LVM_END
+
+  return NULL;
+}
+
+/* Evaluation depth */
+
+int lvm_max_depth = 10000;
+int lvm_depth = 0;
+int lvm_depth_reached = 0;
+int lvm_depth_base = 0;
+
+/* Runs nested on the C stack, and the stack address of the outermost */
+static int lvm_nested = 0;
+static uintptr_t lvm_stack_top = 0;
+
+/* Error for an evaluation going past lvm_max_depth */
+lval* lvm_depth_error(void) {
+  return lval_err(LERR_ERR, "Evaluation deeper than %i calls", lvm_max_depth);
+}
+
+/* Run c in e */
+lval* lvm_run(lenv* e, lcode* c) {
+  int outer = lvm_depth_base;
+  if (!lvm_push_depth(c->depth)) { return lvm_depth_error(); }
+  lvm_depth_base = lvm_depth - c->depth;
+
+  /* Measure the C stack taken by nested runs */
+  char here;
+  if (lvm_nested++ == 0) { lvm_stack_top = (uintptr_t)&here; }
+  if (lvm_nested > lvm_stat.max_nested) {
+    lvm_stat.max_nested = lvm_nested;
+    lvm_stat.stack_bytes = (long)(lvm_stack_top - (uintptr_t)&here);
+  }
+
+  int roots = lgc_root_height();
+  lgc_push_root(&c->consts);
+  lvm_reserve(c->max_stack);
+
+  /* A run ending with an error leaves values and loop frames behind */
+  int base = lvm_sp;
+  lframe* frame = e->frame;
+  lval* result = c->native ? c->native->code(e, c) : lvm_exec(e, c);
+
+  lvm_sp = base;
+  while (e->frame != frame) { lframe_leave(e); }
+  lgc_pop_roots(roots);
+  lvm_nested--;
+  lvm_depth = lvm_depth_base;
+  lvm_depth_base = outer;
+  return result;
+}
+
+/* Fill s with the evaluation depth statistics */
+void lvm_get_stats(lvm_stats* s) {
+  *s = lvm_stat;
+  s->max_depth = lvm_depth_reached;
+}
+
+/* Print the evaluation depth statistics */
+void lvm_print_stats(void) {
+  lvm_stats s;
+  lvm_get_stats(&s);
+  printf("eval: %i calls pending at most, limit %i\n",
+         s.max_depth, lvm_max_depth);
+  printf("eval: %i runs nested on the C stack at most, %li bytes",
+         s.max_nested, s.stack_bytes);
+  if (s.max_nested > 1) {
+    printf(", %li bytes each", s.stack_bytes / (s.max_nested - 1));
+  }
+  putchar('\n');
+  printf("eval: %li callee cache misses\n", s.callee_misses);
+  printf("tier: %li runs walked, %li codes compiled, %li translated, "
+         "%li deoptimized, %li moved up in a tail chain or a loop\n",
+         s.walked, s.compiled, s.translated, s.deopts, s.looping);
+}
+
+/* Bytecode cache
+ * Entries are kept densely in insertion order and found by the address
+ * of their code through an open-addressing index, as in lenv. Codes are
+ * not roots, their entry is dropped when the collector frees them.
+ */
+static struct {
+  lval** src;           /* compiled lists */
+  lval** consts;        /* their constants, collector roots */
+  lcode* code;          /* their bytecode, consts unused */
+  int count;
+  int capacity;
+  int* index;           /* position in the entries + 1, 0 when empty */
+  int index_capacity;
+} lcache;
+
+/* Home slot of list v in the cache index */
+static int lcache_home(lval* v) {
+  uintptr_t h = (uintptr_t)v >> 4;
+  h *= (uintptr_t)0x9E3779B97F4A7C15ULL;
+  return (int)((h >> 16) & (lcache.index_capacity - 1));
+}
+
+/* Slot of the cache index holding v, or the empty slot where it goes */
+static int lcache_slot(lval* v) {
+  int i = lcache_home(v);
+  while (lcache.index[i] && lcache.src[lcache.index[i]-1] != v) {
+    i = (i + 1) & (lcache.index_capacity - 1);
+  }
+  return i;
+}
+
+/* Rebuild the cache index with capacity slots */
+static void lcache_rehash(int capacity) {
+  free(lcache.index);
+  lcache.index = calloc(capacity, sizeof(int));
+  lcache.index_capacity = capacity;
+  for (int j = 0; j < lcache.count; j++) {
+    lcache.index[lcache_slot(lcache.src[j])] = j + 1;
+  }
+}
+
+/* Codes replaced while they may still be running, freed once no run is
+ * in progress
+ */
+static lcode* lcache_retired = NULL;
+static int lcache_retired_count = 0;
+static int lcache_retired_capacity = 0;
+
+/* Free c once no run is in progress */
+static void lcache_retire(lcode* c) {
+  if (lcache_retired_count == lcache_retired_capacity) {
+    lcache_retired_capacity = lcache_retired_capacity ?
+      lcache_retired_capacity * 2 : 16;
+    lcache_retired = realloc(lcache_retired,
+                             sizeof(lcode) * lcache_retired_capacity);
+  }
+  lcache_retired[lcache_retired_count++] = *c;
+}
+
+/* Compile list v, folded against e, into cache entry j */
+static void lcache_compile(int j, lenv* e, lval* v) {
+  int deopts = lcache.code[j].deopts;
+  lval* folded = lval_fold(e, v);
+  lcode_compile(&lcache.code[j], folded);
+  if (folded != v) { lcache.code[j].version = lenv_const_version; }
+  lcache.code[j].deopts = deopts;
+  lcache.consts[j] = lcache.code[j].consts;
+  lcache.code[j].consts = NULL;
+}
+
+/* Keep the native code a run of the cached code of v translated it to
+ * for its next runs, unless the entry changed while it ran
+ */
+static void lcache_adopt(lval* v, lcode* c) {
+  int j = lcache.index[lcache_slot(v)] - 1;
+  if (j >= 0 && lcache.code[j].ops == c->ops &&
+      lcache.code[j].native == NULL) {
+    lcache.code[j].native = c->native;
+    return;
+  }
+  lcode dropped = { 0 };
+  dropped.native = c->native;
+  lcache_retire(&dropped);
+}
+
+/* Cache entry of list v, compiled once it leaves the first tier
+ * Code that was folded is compiled again once a binding changed.
+ */
+static int lcache_get(lenv* e, lval* v) {
+  if (v->flags & LVAL_F_COMPILED) {
+    int j = lcache.index[lcache_slot(v)] - 1;
+    int version = lcache.code[j].version;
+    if (version >= 0 && version != lenv_const_version) {
+      lcache_retire(&lcache.code[j]);
+      lcache_compile(j, e, v);
+    }
+    return j;
+  }
+
+  if (lcache.src == NULL) { lgc_add_range(&lcache.consts, &lcache.count); }
+  if (2 * (lcache.count + 1) > lcache.index_capacity) {
+    lcache_rehash(lcache.index_capacity ? lcache.index_capacity * 2 : 64);
+  }
+  if (lcache.count == lcache.capacity) {
+    lcache.capacity = lcache.capacity ? lcache.capacity * 2 : 32;
+    lcache.src = realloc(lcache.src, sizeof(lval*) * lcache.capacity);
+    lcache.consts = realloc(lcache.consts, sizeof(lval*) * lcache.capacity);
+    lcache.code = realloc(lcache.code, sizeof(lcode) * lcache.capacity);
+  }
+
+  int j = lcache.count;
+  memset(&lcache.code[j], 0, sizeof(lcode));
+  lcache.code[j].version = -1;
+  lcache.consts[j] = NULL;
+  lcache.src[j] = v;
+  lcache.count++;
+  lcache.index[lcache_slot(v)] = j + 1;
+  v->flags |= LVAL_F_COMPILED;
+  return j;
+}
+
+/* Drop the cached bytecode of list v, it is being freed */
+void lvm_forget(lval* v) {
+  int i = lcache_slot(v);
+  int j = lcache.index[i] - 1;
+  lcode_free(&lcache.code[j]);
+
+  /* Free slot i, shifting back the entries after it in its probe run */
+  int mask = lcache.index_capacity - 1;
+  lcache.index[i] = 0;
+  for (int k = (i + 1) & mask; lcache.index[k]; k = (k + 1) & mask) {
+    int home = lcache_home(lcache.src[lcache.index[k]-1]);
+    if (((k - home) & mask) >= ((k - i) & mask)) {
+      lcache.index[i] = lcache.index[k];
+      lcache.index[k] = 0;
+      i = k;
+    }
+  }
+
+  /* Move the last entry into the hole */
+  int last = --lcache.count;
+  if (j != last) {
+    lcache.src[j] = lcache.src[last];
+    lcache.consts[j] = lcache.consts[last];
+    lcache.code[j] = lcache.code[last];
+    lcache.index[lcache_slot(lcache.src[j])] = j + 1;
+  }
+}
+
+/* Tail evaluations */
+
+/* Typed as an error, so that runs return it at once, see lvm_exec */
+lval lvm_tail_marker;
+
+/* Pending tail evaluation, a collector root */
+static lval* ltail_value[1];
+static lval** ltail_values = ltail_value;
+static int ltail_count = 1;
+static lenv* ltail_env;
+
+/* Evaluate v in e in place of the builtin call returning this */
+lval* lvm_tail(lenv* e, lval* v) {
+  static int registered = 0;
+  if (!registered) {
+    lgc_add_range(&ltail_values, &ltail_count);
+    registered = 1;
+  }
+  ltail_env = e;
+  ltail_value[0] = v;
+  return LVM_TAIL;
+}
+
+/* Take the pending tail evaluation, set *e to its environment */
+lval* lvm_take_tail(lenv** e) {
+  lval* v = ltail_value[0];
+  ltail_value[0] = NULL;
+  *e = ltail_env;
+  return v;
+}
+
+/* Tiers */
+
+ltier_config ltier = { 1, LJIT_HOT_RUNS, 64, 4 };
+
+/* Read the tier thresholds from the environment */
+static void ltier_configure(void) {
+  char* s = getenv("LISPY_TIER_VM");
+  if (s && atoi(s) >= 0) { ltier.vm_runs = atoi(s); }
+  s = getenv("LISPY_TIER_JIT");
+  if (s && atoi(s) > 0) { ltier.jit_runs = atoi(s); }
+  s = getenv("LISPY_TIER_DEOPT");
+  if (s && atoi(s) > 0) { ltier.deopt_bailouts = atoi(s); }
+}
+
+/* Move the code of cache entry j, list v, to the tier it should run in
+ * Return 0 while it is still walked. looping is set within a tail chain.
+ */
+static int ltier_update(int j, lenv* e, lval* v, int looping) {
+  lcode* k = &lcache.code[j];
+  k->runs++;
+
+  if (k->ops == NULL) {
+    if (k->runs <= ltier.vm_runs && !lform_has_loop(v)) {
+      lvm_stat.walked++;
+      return 0;
+    }
+    lcache_compile(j, e, v);
+    k->runs = 1;
+    lvm_stat.compiled++;
+    if (looping) { lvm_stat.looping++; }
+  }
+
+  /* Drop native code whose guards keep failing, it may still be running */
+  if (k->native && k->native->bailouts >= ltier.deopt_bailouts) {
+    lcode dropped = { 0 };
+    dropped.native = k->native;
+    lcache_retire(&dropped);
+    k->native = NULL;
+    k->runs = 1;
+    k->deopts++;
+    lvm_stat.deopts++;
+  }
+
+  /* Hot code is translated once its inline caches are filled */
+  if (k->runs == ltier.jit_runs && k->native == NULL && ljit_enabled &&
+      k->deopts < ltier.max_deopts) {
+    lcode c = *k;
+    c.consts = lcache.consts[j];
+    if (ljit_compile(&c, &lvm_jit)) {
+      k->native = c.native;
+      lvm_stat.translated++;
+      if (looping) { lvm_stat.looping++; }
+    }
+  }
+  return 1;
+}
+
+/* Evaluate v in e on the VM, may return LVM_TAIL
+ * looping is set for the tail evaluations of a chain.
+ */
+static lval* lvm_eval_code(lenv* e, lval* v, int looping) {
+
+  /* Values other than code evaluate to themselves */
+  int t = lval_type(v);
+  if (t != LVAL_SYM && t != LVAL_REF && t != LVAL_LIST) { return v; }
+
+  /* Code that may still move or die young is compiled for this run only */
+  lcode c;
+  if (t != LVAL_LIST || (v->flags & LVAL_F_ARENA)) {
+    lcode_compile(&c, v);
+    lval* r = lvm_run(e, &c);
+    lcode_free(&c);
+    return r;
+  }
+
+  int j = lcache_get(e, v);
+  if (!ltier_update(j, e, v, looping)) { return lval_eval_tree_step(e, v); }
+
+  /* v is kept alive while its cached bytecode runs */
+  c = lcache.code[j];
+  c.consts = lcache.consts[j];
+
+  ljit_native* native = c.native;
+  int roots = lgc_root_height();
+  lgc_push_root(&v);
+  lval* r = lvm_run(e, &c);
+  if (c.native != native) { lcache_adopt(v, &c); }
+  lgc_pop_roots(roots);
+  return r;
+}
+
+/* Evaluate v in e with the engine selected by lvm_engine
+ * This is the trampoline of the VM: tail evaluations returned by the
+ * code run here, instead of nesting on the C stack.
+ */
+lval* lvm_eval(lenv* e, lval* v) {
+  if (lvm_engine == LVM_ENGINE_DEFAULT) {
+    char* s = getenv("LISPY_ENGINE");
+    lvm_engine = s && strcmp(s, "tree") == 0 ?
+      LVM_ENGINE_TREE : LVM_ENGINE_VM;
+    s = getenv("LISPY_MAX_DEPTH");
+    if (s && atoi(s) > 0) { lvm_max_depth = atoi(s); }
+    s = getenv("LISPY_JIT");
+    if (s && strcmp(s, "0") == 0) { ljit_enabled = 0; }
+    ltier_configure();
+  }
+  if (lvm_engine == LVM_ENGINE_TREE) { return lval_eval_tree(e, v); }
+
+  if (lvm_nested == 0) {
+    while (lcache_retired_count) {
+      lcode_free(&lcache_retired[--lcache_retired_count]);
+    }
+  }
+
+  lval* r = lvm_eval_code(e, v, 0);
+  while (r == LVM_TAIL) {
+    v = lvm_take_tail(&e);
+    r = lvm_eval_code(e, v, 1);
+  }
+  return r;
+}
@@ -0,0 +1,231 @@
+#if !defined(__LVM_H__)
+#define __LVM_H__
+
+#include "lval.h"
+
+/* Bytecode compiler and stack virtual machine
+ *
+ * Code is compiled into a flat array of instructions for a stack machine.
+ * Each instruction is an opcode followed by its operands, one word each:
+ *
+ *   CONST i           push constant i
+ *   SYM i             push the value of symbol constant i, looked up by name
+ *   GLOBAL i          push the value of global reference constant i
+ *   LOCAL d s         push slot s of the frame d levels up
+ *   CALLEE i v e f    push the function of a call, the value of symbol or
+ *                     global reference constant i, through an inline
+ *                     cache: f was its value in environment e at binding
+ *                     version v (see lenv_version)
+ *   CALL n l          call the function below the top n values with them
+ *                     as arguments, replace all of them with the result,
+ *                     l calls being pending in the run with it
+ *   CONST_CALL i n l  CONST i then CALL n l
+ *   GLOBAL_CALL i n l GLOBAL i then CALL n l
+ *   RETURN            return the top value
+ *   FAIL i            return error constant i
+ *   JUMP o            continue at offset o
+ *   LOOP o            continue at offset o, back to the test of a while
+ *                     loop
+ *   BRANCH o          pop the top value and continue at offset o when it
+ *                     is false
+ *   AND o             continue at o when the top value is false, else pop
+ *                     it
+ *   OR o              continue at o when the top value is true, else pop
+ *                     it
+ *   DROP              pop the top value
+ *   DOTIMES i o       start the dotimes loop binding symbol constant i
+ *                     on the top value, see lform_enter: pop it and go on
+ *                     in the new frame, or replace it with () and
+ *                     continue at o
+ *   FOREACH i o       likewise for a for-each loop
+ *   STEP o            step the dotimes loop of the innermost frame, and
+ *                     continue at o unless it is done
+ *   EACH o            likewise for a for-each loop
+ *   LEAVE             remove the innermost frame
+ *   DEPTH n           make n calls pending in the run from here on, if
+ *                     fewer are, see lvm_depth_base
+ *
+ * The jumps compile special forms (see lform.h). A form in tail position
+ * returns from each of its branches, so that calls there are tail calls
+ * too. Loops run their bodies between the instruction starting them and
+ * the one stepping them, which jumps back. A symbol the loops being
+ * compiled bind is compiled as LOCAL even in code that was not resolved.
+ * An operand of a form that may not run starts with a DEPTH when it has
+ * calls of its own.
+ *
+ * Errors end a run at once: a lookup or a call giving one returns it
+ * from the run, without evaluating what is left, and lvm_run drops the
+ * values and the loop frames the run left behind. Values on the stack
+ * are never errors, and the error of a malformed form is given by FAIL.
+ *
+ * The two superinstructions add two fixnums without a call when the
+ * function is builtin_add.
+ *
+ * Constants are kept in an lval list, so the collector sees them and
+ * updates them when they move. The value stack is a collector root too.
+ * A safepoint is reached before each call.
+ *
+ * Code outside of the nursery never changes or moves, so its bytecode is
+ * compiled once and cached until the collector frees the code. It is
+ * folded first (see lfold.h) and compiled again if a binding it was
+ * folded against changes.
+ *
+ * Cached code runs in tiers, see ltier below, and bytecode that runs
+ * often is translated to native code where that is supported, see ljit.h.
+ *
+ * The tree walker is kept for comparison: set LISPY_ENGINE=tree in the
+ * environment to evaluate with it.
+ */
+
+#define LOP_LIST(X) \
+  X(CONST, 1) X(SYM, 1) X(GLOBAL, 1) X(LOCAL, 2) X(CALLEE, 4) X(CALL, 2) \
+  X(CONST_CALL, 3) X(GLOBAL_CALL, 3) X(RETURN, 0) X(FAIL, 1) X(JUMP, 1) \
+  X(BRANCH, 1) X(AND, 1) X(OR, 1) X(DROP, 0) X(DOTIMES, 2) X(FOREACH, 2) \
+  X(STEP, 1) X(EACH, 1) X(LEAVE, 0) X(DEPTH, 1) X(LOOP, 1)
+
+#define LOP_ENUM(name, n) LOP_##name,
+enum { LOP_LIST(LOP_ENUM) LOP_COUNT };
+
+/* Instruction word: an opcode, or the address of its code, or an operand */
+typedef intptr_t lword;
+
+/* Evaluation engines */
+enum { LVM_ENGINE_DEFAULT, LVM_ENGINE_TREE, LVM_ENGINE_VM };
+
+/* Engine lval_eval uses, the default is read from LISPY_ENGINE */
+extern int lvm_engine;
+
+typedef struct lcode {
+  lword* ops;
+  int count;
+  int capacity;
+  lval* consts;         /* list of constants */
+  int max_stack;        /* values pushed at most by the code */
+  int depth;            /* calls pending at most outside of the operands
+                           starting with a DEPTH */
+  int version;          /* lenv_const_version it was folded at, or -1 */
+  int last;             /* offset of the last instruction, while compiling */
+  int runs;             /* times run from the cache in its current tier */
+  int deopts;           /* times its native code was dropped */
+  struct ljit_native* native;   /* native code, see ljit.h, or NULL */
+} lcode;
+
+/* Compile v into c */
+void lcode_compile(lcode* c, lval* v);
+
+/* Release what c holds, the constants are left to the collector */
+void lcode_free(lcode* c);
+
+/* Print the instructions of c */
+void lcode_print(lcode* c);
+
+/* Run c in e */
+lval* lvm_run(lenv* e, lcode* c);
+
+/* Tail evaluations
+ * A builtin whose result is the evaluation of some code returns
+ * lvm_tail(e, v) instead of lval_eval(e, v). The caller of the builtin
+ * then evaluates v in place of the call: a trampoline loop in lvm_eval
+ * and lval_eval_tree when the call is in tail position, so chains of
+ * tail evaluations run in constant C stack, or right away otherwise.
+ * LVM_TAIL is only ever seen by the callers of builtins.
+ */
+extern lval lvm_tail_marker;
+#define LVM_TAIL (&lvm_tail_marker)
+
+/* Evaluate v in e in place of the builtin call returning this */
+lval* lvm_tail(lenv* e, lval* v);
+
+/* Take the pending tail evaluation, set *e to its environment */
+lval* lvm_take_tail(lenv** e);
+
+/* Tiers
+ * Code kept in the bytecode cache is walked by the tree walker for its
+ * first vm_runs runs, so that code run once is not compiled, unless it
+ * has a loop form whose bodies will run many times. Then it is compiled
+ * to bytecode, which is translated to native code once it ran jit_runs
+ * more times and its inline caches are filled. Native code whose inline
+ * templates bailed out deopt_bailouts times is dropped back to bytecode,
+ * and translated again after jit_runs more runs with what its caches
+ * found by then, max_deopts times at most.
+ *
+ * The tier is chosen again on each tail evaluation the trampoline of
+ * lvm_eval runs, so a long chain of them, a loop written with eval, is
+ * moved up while it runs instead of finishing in the tier it started in.
+ * Likewise bytecode whose loops jumped back jit_runs times in a run is
+ * translated then, and the run goes on in native code from the head of
+ * the loop, even for code that is not cached.
+ *
+ * The thresholds are read at startup from LISPY_TIER_VM, LISPY_TIER_JIT
+ * and LISPY_TIER_DEOPT.
+ */
+typedef struct ltier_config {
+  int vm_runs;
+  int jit_runs;
+  int deopt_bailouts;
+  int max_deopts;
+} ltier_config;
+
+extern ltier_config ltier;
+
+/* Drop the cached bytecode of list v, it is being freed */
+void lvm_forget(lval* v);
+
+/* Evaluate v in e with the engine selected by lvm_engine */
+lval* lvm_eval(lenv* e, lval* v);
+
+/* Evaluation depth
+ * Both engines keep the calls they have pending on heap stacks, so deeply
+ * nested code does not grow the C stack: only a builtin evaluating code
+ * outside of tail position starts a nested run there. Once more than
+ * lvm_max_depth calls would be pending, evaluation gives an error
+ * instead. The limit is read from LISPY_MAX_DEPTH, 10000 by default.
+ */
+extern int lvm_max_depth;
+
+/* Calls pending now, and the most ever pending */
+extern int lvm_depth;
+extern int lvm_depth_reached;
+
+/* Calls pending as the innermost run started
+ * A run charges the calls its code always leaves pending as it starts,
+ * and those of an operand that may not run as it reaches its DEPTH, so
+ * that both engines accept the same code. They are counted as in the tree
+ * walker and all dropped as the run ends.
+ */
+extern int lvm_depth_base;
+
+/* Add n pending calls, return 0 instead if that passes the limit */
+static inline int lvm_push_depth(int n) {
+  if (lvm_depth + n > lvm_max_depth) { return 0; }
+  lvm_depth += n;
+  if (lvm_depth > lvm_depth_reached) { lvm_depth_reached = lvm_depth; }
+  return 1;
+}
+
+/* Remove n pending calls */
+static inline void lvm_pop_depth(int n) { lvm_depth -= n; }
+
+/* Error for an evaluation going past lvm_max_depth */
+lval* lvm_depth_error(void);
+
+typedef struct lvm_stats {
+  int max_depth;        /* most calls pending at once */
+  int max_nested;       /* most runs nested on the C stack */
+  long stack_bytes;     /* C stack used by that many runs */
+  long callee_misses;   /* callee lookups not found in their cache */
+  long walked;          /* cached code runs left to the tree walker */
+  long compiled;        /* codes moved up to bytecode */
+  long translated;      /* codes moved up to native code */
+  long deopts;          /* native codes dropped back to bytecode */
+  long looping;         /* of the moves up, those inside a tail chain
+                           or a loop */
+} lvm_stats;
+
+/* Fill s with the evaluation depth statistics */
+void lvm_get_stats(lvm_stats* s);
+
+/* Print the evaluation depth statistics */
+void lvm_print_stats(void);
+
+#endif
@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "lval.h"
+#include "lgc.h"
+#include "lresolve.h"
+#include "lfold.h"
 #include "mpc.h"
 
 typedef struct {
@@ -100,15 +103,19 @@ int parse_string(lenv* e, char *input)
     /* Parse AST into List */
     lval *llist = NULL;
     llist = lval_read(r.output);
+    llist = lval_resolve(NULL, llist);
     printf("Parsing result: ");lval_println(llist);
+    llist = lval_fold(e, llist);
     //lval_del(llist);
 #if 1
     /* Evaluate List */
     lval *result;
     result = lval_eval(e, llist);
     printf("Evaluating result: ");lval_println(result);
-    lval_del(result);
 #endif
+
+    /* Only the environment is left to keep values alive */
+    lgc_safepoint();
     mpc_ast_delete(r.output);
 
   } else {
@@ -25,6 +25,9 @@ int main(int argc, char** argv) {
     
     /* Output our prompt and get input */
     char* input = readline("lispy> ");
+
+    /* End of input, as when it is piped */
+    if (input == NULL) { break; }
     
     /* Add input to history */
     add_history(input);
@@ -0,0 +1,92 @@
+(def '(y) 1)
+(def '(y) 2)
+(def '(k) '(+ y 1))
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(def '(y) 4611686018427387903)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(eval k)
+(def '(y) 4611686018427387904)
+(eval k)
+(eval k)
+(eval k)
+(def '(y) 5)
+(eval k)
+(eval k)
+(eval k)
+(def '(y) '(5))
+(eval k)
+(def '(y) 7)
+(eval k)
+(def '(f) +)
+(def '(f) +)
+(def '(r) '(f y 10))
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(eval r)
+(def '(f) -)
+(eval r)
+(eval r)
+(eval r)
+(def '(f) *)
+(eval r)
+(def '(f) +)
+(eval r)
+(def '(z) 0)
+(def '(z) 4611686018427387900)
+(dotimes (i 20) (/ 1 (- (+ z i) 4611686018427387915)))
+(dotimes (i 20) (/ 1 (- (+ z i) 4611686018427387925)))
+(dotimes (i 20) (* z i))
+(def '(z) -4611686018427387900)
+(dotimes (i 20) (/ 1 (- (- z i) -4611686018427387912)))
+(def '(s) 4611686018427387890)
+(dotimes (i 40) (def '(s) (+ s 1)))
+s
+(def '(p) 1)
+(dotimes (i 70) (def '(p) (* p 2)))
+p
+(def '(s) 0)
+(def '(g) '(dotimes (i 10) (def '(s) (+ s i))))
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+(eval g)
+s
+(def '(n) 0)
+(while (- 30 n) (def '(n) (+ n 1)))
+n
+(def '(t) 0)
+(for-each (x '(1 2 3 4 5 6 7 8 9 10 11 12)) (def '(t) (+ t x)))
+t
+(def '(t) 0)
+(dotimes (i 12) (def '(t) (+ t i)) (if (- i 11) 0 (undefined)))
+t